@@ -0,0 +1,88 @@
+#ifndef DEVICE_BACKEND_R7WQ2HNC
+#define DEVICE_BACKEND_R7WQ2HNC
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+#include <libfreenect/libfreenect.h>
+#include <libfreenect/libfreenect_registration.h>
+
+namespace freenect_camera {
+
+  /**
+   * \class DeviceBackend
+   *
+   * \brief What FreenectDevice needs from one camera: modes, the buffer the
+   * next frame is written into and starting/stopping the streams. Completed
+   * frames are reported to the Listener from DriverBackend::processEvents().
+   */
+  class DeviceBackend {
+
+    public:
+
+      class Listener {
+        public:
+          virtual ~Listener() {}
+          /** \brief depth was written into the buffer last set with setDepthBuffer() */
+          virtual void depthFrameReady(void* depth, uint32_t timestamp) = 0;
+          /** \brief video was written into the buffer last set with setVideoBuffer() */
+          virtual void videoFrameReady(void* video, uint32_t timestamp) = 0;
+      };
+
+      virtual ~DeviceBackend() {}
+
+      virtual void setListener(Listener* listener) = 0;
+
+      /** \brief Calibration of the camera, valid until close() */
+      virtual const freenect_registration& registration() const = 0;
+
+      virtual void setVideoMode(const freenect_frame_mode& mode) = 0;
+      virtual void setVideoBuffer(void* buffer) = 0;
+      virtual void startVideo() = 0;
+      virtual void stopVideo() = 0;
+
+      virtual void setDepthMode(const freenect_frame_mode& mode) = 0;
+      virtual void setDepthBuffer(void* buffer) = 0;
+      virtual void startDepth() = 0;
+      virtual void stopDepth() = 0;
+
+      /** \brief Stops everything, calling it again does nothing */
+      virtual void close() = 0;
+  };
+
+  typedef boost::shared_ptr<DeviceBackend> DeviceBackendPtr;
+
+  /**
+   * \class DriverBackend
+   *
+   * \brief Finds and opens cameras and runs their event loop, see
+   * LibfreenectDriverBackend for USB devices and ReplayDriverBackend for
+   * recorded frames.
+   */
+  class DriverBackend {
+
+    public:
+
+      virtual ~DriverBackend() {}
+
+      virtual std::vector<std::string> listSerials() = 0;
+
+      virtual DeviceBackendPtr openDevice(const std::string& serial) = 0;
+
+      /**
+       * \brief Delivers the frames that are ready, waiting up to timeout_ms
+       * for some. Called over and over by the driver's event thread.
+       */
+      virtual void processEvents(int timeout_ms) = 0;
+
+      virtual void enableDebug() {}
+
+      virtual void shutdown() = 0;
+  };
+
+  typedef boost::shared_ptr<DriverBackend> DriverBackendPtr;
+
+}
+
+#endif /* end of include guard: DEVICE_BACKEND_R7WQ2HNC */
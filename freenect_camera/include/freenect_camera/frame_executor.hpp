@@ -0,0 +1,171 @@
+#ifndef FRAME_EXECUTOR_H7WC2P4N
+#define FRAME_EXECUTOR_H7WC2P4N
+
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace freenect_camera {
+
+  /**
+   * \class FrameExecutor
+   *
+   * \brief Runs frame handlers on a pool of worker threads, so the libfreenect
+   * thread only has to hand frames off.
+   *
+   * Every stream has a latest-wins mailbox: posting a frame replaces one that
+   * has not been picked up yet, and the replaced frame is counted as dropped
+   * instead of being queued. A stream's handler never runs on two workers at
+   * the same time, so frames of one stream are processed in order. With zero
+   * workers, post() runs the handler right away on the calling thread. Frames
+   * posted before start() or after stop() are discarded.
+   */
+  template <typename Frame>
+  class FrameExecutor : public boost::noncopyable {
+
+    public:
+
+      typedef boost::function<void(const Frame&)> Handler;
+
+      FrameExecutor() : running_(false), worker_count_(0), next_(0) {}
+
+      ~FrameExecutor() {
+        stop();
+      }
+
+      /** Register a stream. Must be called before start() */
+      unsigned addStream(const Handler& handler) {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        mailboxes_.push_back(Mailbox(handler));
+        return mailboxes_.size() - 1;
+      }
+
+      void start(unsigned worker_count) {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        running_ = true;
+        worker_count_ = worker_count;
+        for (unsigned i = 0; i < worker_count; ++i) {
+          workers_.create_thread(boost::bind(&FrameExecutor::run, this));
+        }
+      }
+
+      /** Join the workers and release frames nobody picked up */
+      void stop() {
+        {
+          boost::lock_guard<boost::mutex> lock(mutex_);
+          running_ = false;
+        }
+        ready_.notify_all();
+        workers_.join_all();
+
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        worker_count_ = 0;
+        for (size_t i = 0; i < mailboxes_.size(); ++i) {
+          mailboxes_[i].pending = Frame();
+          mailboxes_[i].has_pending = false;
+        }
+      }
+
+      /** Hand a frame to the stream's handler */
+      void post(unsigned stream, const Frame& frame) {
+        Frame replaced;
+        bool run_inline;
+        {
+          boost::lock_guard<boost::mutex> lock(mutex_);
+          if (!running_) {
+            return;
+          }
+          run_inline = worker_count_ == 0;
+          if (!run_inline) {
+            Mailbox& mailbox = mailboxes_[stream];
+            if (mailbox.has_pending) {
+              ++mailbox.dropped;
+            }
+            // The replaced frame is released outside of the lock
+            replaced = mailbox.pending;
+            mailbox.pending = frame;
+            mailbox.has_pending = true;
+          }
+        }
+        if (run_inline) {
+          mailboxes_[stream].handler(frame);
+        } else {
+          ready_.notify_one();
+        }
+      }
+
+      /** Frames replaced in the mailbox before any worker picked them up */
+      uint64_t droppedFrames(unsigned stream) {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        return mailboxes_[stream].dropped;
+      }
+
+    private:
+
+      struct Mailbox {
+        explicit Mailbox(const Handler& handler)
+          : handler(handler), has_pending(false), busy(false), dropped(0) {}
+
+        Handler handler;
+        Frame pending;
+        bool has_pending;
+        /** A worker is running the handler */
+        bool busy;
+        uint64_t dropped;
+      };
+
+      boost::mutex mutex_;
+      boost::condition_variable ready_;
+      std::vector<Mailbox> mailboxes_;
+      boost::thread_group workers_;
+      bool running_;
+      unsigned worker_count_;
+      /** Mailbox to look at first, so no stream starves the others */
+      size_t next_;
+
+      /** Index of a mailbox with a frame no worker is handling, or -1 */
+      int findReadyMailbox() {
+        for (size_t i = 0; i < mailboxes_.size(); ++i) {
+          size_t index = (next_ + i) % mailboxes_.size();
+          if (mailboxes_[index].has_pending && !mailboxes_[index].busy) {
+            next_ = index + 1;
+            return index;
+          }
+        }
+        return -1;
+      }
+
+      void run() {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        while (running_) {
+          int index = findReadyMailbox();
+          if (index < 0) {
+            ready_.wait(lock);
+            continue;
+          }
+
+          Mailbox& mailbox = mailboxes_[index];
+          Frame frame = mailbox.pending;
+          mailbox.pending = Frame();
+          mailbox.has_pending = false;
+          mailbox.busy = true;
+
+          lock.unlock();
+          mailbox.handler(frame);
+          // Release the frame before taking the lock again
+          frame = Frame();
+          lock.lock();
+
+          mailbox.busy = false;
+        }
+      }
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: FRAME_EXECUTOR_H7WC2P4N */
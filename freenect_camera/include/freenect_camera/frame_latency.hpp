@@ -0,0 +1,130 @@
+#ifndef FRAME_LATENCY_Q3VN8DKS
+#define FRAME_LATENCY_Q3VN8DKS
+
+#include <time.h>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+
+namespace freenect_camera {
+
+  /**
+   * Microseconds on the host clock frames are stamped with on arrival. It is
+   * monotonic, so setting the system time does not distort latencies.
+   */
+  inline uint64_t frameClockUs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000ULL + now.tv_nsec / 1000;
+  }
+
+  /**
+   * \class LatencyHistogram
+   *
+   * \brief Counts latencies in logarithmic buckets, 8 per power of two, so
+   * percentiles are off by at most 12.5%. Recording is lock free and can
+   * happen on any number of threads while another one reads.
+   */
+  class LatencyHistogram {
+
+    public:
+
+      LatencyHistogram() : max_(0) {
+        for (unsigned i = 0; i < BUCKETS; ++i)
+          counts_[i] = 0;
+      }
+
+      void record(uint64_t us) {
+        counts_[bucketOf(us)].fetch_add(1, boost::memory_order_relaxed);
+        uint64_t max = max_.load(boost::memory_order_relaxed);
+        while (us > max && !max_.compare_exchange_weak(max, us, boost::memory_order_relaxed)) {
+        }
+      }
+
+      /** Records the time since start_us, on the frameClockUs() clock */
+      void recordSince(uint64_t start_us) {
+        const uint64_t now = frameClockUs();
+        record(now > start_us ? now - start_us : 0);
+      }
+
+      uint64_t count() const {
+        uint64_t total = 0;
+        for (unsigned i = 0; i < BUCKETS; ++i)
+          total += counts_[i].load(boost::memory_order_relaxed);
+        return total;
+      }
+
+      /**
+       * Upper bound of the bucket holding the given fraction of all
+       * latencies, in microseconds, 0 without any
+       */
+      uint64_t percentile(double fraction) const {
+        uint64_t counts[BUCKETS];
+        uint64_t total = 0;
+        for (unsigned i = 0; i < BUCKETS; ++i)
+          total += counts[i] = counts_[i].load(boost::memory_order_relaxed);
+        if (total == 0)
+          return 0;
+
+        const uint64_t rank = static_cast<uint64_t>(fraction * (total - 1));
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < BUCKETS; ++i) {
+          seen += counts[i];
+          if (seen > rank) {
+            // The maximum is exact, and tighter in the top bucket
+            const uint64_t max = this->max();
+            return upperBoundOf(i) < max ? upperBoundOf(i) : max;
+          }
+        }
+        return max();
+      }
+
+      uint64_t max() const {
+        return max_.load(boost::memory_order_relaxed);
+      }
+
+    private:
+
+      static const unsigned SUB_BITS = 3;
+      static const unsigned SUB_BUCKETS = 1u << SUB_BITS;
+      /** Values below SUB_BUCKETS get a bucket each, then SUB_BUCKETS per power of two */
+      static const unsigned BUCKETS = SUB_BUCKETS * (64 - SUB_BITS + 1);
+
+      static unsigned bucketOf(uint64_t us) {
+        if (us < SUB_BUCKETS)
+          return static_cast<unsigned>(us);
+        unsigned exponent = 63;
+        while (!(us >> exponent))
+          --exponent;
+        const unsigned shift = exponent - SUB_BITS;
+        // The leading bit is implied by the exponent
+        return (shift + 1) * SUB_BUCKETS + static_cast<unsigned>((us >> shift) & (SUB_BUCKETS - 1));
+      }
+
+      static uint64_t upperBoundOf(unsigned bucket) {
+        if (bucket < SUB_BUCKETS)
+          return bucket;
+        const unsigned shift = bucket / SUB_BUCKETS - 1;
+        const uint64_t mantissa = SUB_BUCKETS | (bucket & (SUB_BUCKETS - 1));
+        return ((mantissa + 1) << shift) - 1;
+      }
+
+      boost::atomic<uint64_t> counts_[BUCKETS];
+      boost::atomic<uint64_t> max_;
+  };
+
+  /**
+   * \brief Latency of a stream's frames from their arrival to each stage of
+   * the driver
+   */
+  struct FrameLatencies {
+    /** The driver's frame callback was entered */
+    LatencyHistogram callback;
+    /** The message is ready, just before publishing */
+    LatencyHistogram processed;
+    /** publish() returned */
+    LatencyHistogram published;
+  };
+
+}
+
+#endif /* end of include guard: FRAME_LATENCY_Q3VN8DKS */
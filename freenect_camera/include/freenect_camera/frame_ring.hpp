@@ -0,0 +1,345 @@
+#ifndef FRAME_RING_Q3M8ZK1D
+#define FRAME_RING_Q3M8ZK1D
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <freenect_camera/image_buffer.hpp>
+
+namespace freenect_camera {
+
+  class FrameRing;
+
+  /**
+   * \class FrameAllocator
+   *
+   * \brief Supplies the storage libfreenect writes frames into. The returned
+   * owner keeps the storage alive and is what FrameHandle::detachStorage()
+   * hands to the consumer, e.g. the sensor_msgs::Image the data belongs to.
+   */
+  class FrameAllocator {
+
+    public:
+
+      virtual ~FrameAllocator() {}
+
+      virtual boost::shared_ptr<void> allocate(size_t bytes,
+          boost::shared_array<unsigned char>& data) = 0;
+  };
+
+  typedef boost::shared_ptr<FrameAllocator> FrameAllocatorPtr;
+
+  /**
+   * \class FrameHandle
+   *
+   * \brief Read-only reference to a completed frame stored in a FrameRing
+   * slot. As long as a handle to a slot exists, libfreenect is never pointed
+   * at that slot, so the frame cannot be torn while it is being published.
+   * Copying and destroying handles is lock-free.
+   */
+  class FrameHandle {
+
+    public:
+
+      FrameHandle() : slot_(-1) {}
+
+      FrameHandle(const FrameHandle& other)
+        : ring_(other.ring_), slot_(other.slot_) {
+        retain();
+      }
+
+      FrameHandle& operator=(const FrameHandle& other) {
+        if (this != &other) {
+          FrameHandle copy(other);
+          swap(copy);
+        }
+        return *this;
+      }
+
+      ~FrameHandle() {
+        release();
+      }
+
+      bool valid() const {
+        return slot_ >= 0;
+      }
+
+      void reset() {
+        release();
+        ring_.reset();
+        slot_ = -1;
+      }
+
+      void swap(FrameHandle& other) {
+        ring_.swap(other.ring_);
+        std::swap(slot_, other.slot_);
+      }
+
+      inline const ImageBuffer& operator*() const;
+      inline const ImageBuffer* operator->() const;
+
+      /** Monotonic number of the frame within its ring */
+      inline uint64_t sequence() const;
+
+      /**
+       * Take over the storage of the frame, as returned by the ring's
+       * FrameAllocator. The slot is given fresh storage before libfreenect
+       * writes into it again, so the caller may publish or modify the data.
+       * Returns an empty pointer if the ring has no allocator.
+       */
+      inline boost::shared_ptr<void> detachStorage() const;
+
+    private:
+
+      friend class FrameRing;
+
+      /** Adopts a reader reference the ring has already taken on the slot */
+      FrameHandle(const boost::shared_ptr<FrameRing>& ring, int slot)
+        : ring_(ring), slot_(slot) {}
+
+      inline void retain();
+      inline void release();
+
+      boost::shared_ptr<FrameRing> ring_;
+      int slot_;
+  };
+
+  /**
+   * \class FrameRing
+   *
+   * \brief N-slot ring of frame buffers for one stream. libfreenect always
+   * writes into a slot no reader holds; completed frames are handed out as
+   * FrameHandles. If every slot is held by readers, the next frame goes to a
+   * scratch buffer and is dropped, which is counted as an overwritten frame.
+   *
+   * commit() must only be called from the libfreenect thread. Handles can be
+   * acquired and released from any thread.
+   */
+  class FrameRing
+    : public boost::enable_shared_from_this<FrameRing>, boost::noncopyable {
+
+    public:
+
+      static const unsigned DEFAULT_SLOTS = 4;
+
+      /**
+       * Allocate slot_count buffers in the format described by format. Without
+       * an allocator the buffers are plain heap arrays.
+       */
+      FrameRing(const ImageBuffer& format,
+          const FrameAllocatorPtr& allocator = FrameAllocatorPtr(),
+          unsigned slot_count = DEFAULT_SLOTS)
+        : slots_(slot_count < 3 ? 3 : slot_count), allocator_(allocator),
+          latest_(-1), sequence_(0), overwritten_(0) {
+        for (unsigned i = 0; i < slots_.size(); ++i) {
+          initializeSlot(slots_[i], format);
+        }
+        initializeSlot(scratch_, format);
+        writing_ = 0;
+        slots_[0].state.store(WRITER);
+      }
+
+      unsigned size() const {
+        return slots_.size();
+      }
+
+      const freenect_frame_mode& metadata() const {
+        return scratch_.buffer.metadata;
+      }
+
+      /** Buffer libfreenect should fill with the next frame */
+      unsigned char* writeBuffer() const {
+        return writingSlot().buffer.image_buffer.get();
+      }
+
+      /**
+       * Publish the frame that was just written into writeBuffer() and claim
+       * a free slot for the next one, with the frame's device timestamp and
+       * arrival time. Returns an invalid handle if the frame landed in the
+       * scratch buffer.
+       */
+      FrameHandle commit(uint32_t timestamp = 0, uint64_t arrival_us = 0) {
+        FrameHandle frame;
+        int completed = writing_;
+
+        if (completed < 0) {
+          overwritten_.fetch_add(1, boost::memory_order_relaxed);
+        } else {
+          Slot& slot = slots_[completed];
+          slot.sequence = ++sequence_;
+          slot.buffer.timestamp = timestamp;
+          slot.buffer.arrival_us = arrival_us;
+          // Trade the writer bit for the reader reference owned by frame
+          slot.state.fetch_sub(WRITER - 1, boost::memory_order_release);
+          latest_.store(completed, boost::memory_order_release);
+          frame = FrameHandle(shared_from_this(), completed);
+        }
+
+        writing_ = claimFreeSlot(latest_.load(boost::memory_order_relaxed));
+        return frame;
+      }
+
+      /** Most recent completed frame, or an invalid handle if there is none */
+      FrameHandle acquireLatest() {
+        for (;;) {
+          int slot = latest_.load(boost::memory_order_acquire);
+          if (slot < 0) {
+            return FrameHandle();
+          }
+          boost::uint32_t previous =
+            slots_[slot].state.fetch_add(1, boost::memory_order_acquire);
+          if (!(previous & WRITER)) {
+            return FrameHandle(shared_from_this(), slot);
+          }
+          // The slot was recycled after we read latest_, try again
+          slots_[slot].state.fetch_sub(1, boost::memory_order_release);
+        }
+      }
+
+      /** Frames dropped because every slot was held by a reader */
+      uint64_t overwrittenFrames() const {
+        return overwritten_.load(boost::memory_order_relaxed);
+      }
+
+    private:
+
+      friend class FrameHandle;
+
+      static const boost::uint32_t WRITER = 0x80000000u;
+
+      struct Slot {
+        Slot() : state(0), sequence(0), detached(false) {}
+        Slot(const Slot& other) : state(0), sequence(0), detached(false) {
+          assert(!other.buffer.image_buffer && "Slots are only copied before allocation.");
+        }
+
+        ImageBuffer buffer;
+        boost::shared_ptr<void> owner;
+        /** Reader count, with WRITER set while libfreenect owns the slot */
+        boost::atomic<boost::uint32_t> state;
+        uint64_t sequence;
+        /** Set once a consumer took over the storage */
+        boost::atomic<bool> detached;
+      };
+
+      std::vector<Slot> slots_;
+      Slot scratch_;
+      FrameAllocatorPtr allocator_;
+      /** Slot libfreenect is writing into, -1 for the scratch buffer */
+      int writing_;
+      boost::atomic<int> latest_;
+      uint64_t sequence_;
+      boost::atomic<uint64_t> overwritten_;
+
+      void initializeSlot(Slot& slot, const ImageBuffer& format) {
+        slot.buffer.metadata = format.metadata;
+        slot.buffer.focal_length = format.focal_length;
+        slot.buffer.is_registered = format.is_registered;
+        allocateStorage(slot);
+      }
+
+      void allocateStorage(Slot& slot) {
+        // Drop the old storage first, so an allocator can recycle it
+        slot.buffer.image_buffer.reset();
+        slot.owner.reset();
+        if (allocator_) {
+          slot.owner = allocator_->allocate(slot.buffer.metadata.bytes,
+              slot.buffer.image_buffer);
+        } else {
+          slot.buffer.image_buffer.reset(
+              new unsigned char[slot.buffer.metadata.bytes]);
+        }
+        slot.detached.store(false, boost::memory_order_relaxed);
+      }
+
+      const Slot& writingSlot() const {
+        return writing_ < 0 ? scratch_ : slots_[writing_];
+      }
+
+      /** Take ownership of the oldest slot without readers */
+      int claimFreeSlot(int latest) {
+        for (;;) {
+          int candidate = -1;
+          for (unsigned i = 0; i < slots_.size(); ++i) {
+            if (static_cast<int>(i) == latest ||
+                slots_[i].state.load(boost::memory_order_relaxed) != 0) {
+              continue;
+            }
+            if (candidate < 0 || slots_[i].sequence < slots_[candidate].sequence) {
+              candidate = i;
+            }
+          }
+          if (candidate < 0) {
+            return -1;
+          }
+          boost::uint32_t expected = 0;
+          if (slots_[candidate].state.compare_exchange_strong(
+                expected, WRITER, boost::memory_order_acquire)) {
+            if (slots_[candidate].detached.load(boost::memory_order_acquire)) {
+              allocateStorage(slots_[candidate]);
+            }
+            return candidate;
+          }
+          // A reader grabbed the candidate in the meantime, look again
+        }
+      }
+
+      const ImageBuffer& buffer(int slot) const {
+        return slots_[slot].buffer;
+      }
+
+      boost::shared_ptr<void> detach(int slot) {
+        slots_[slot].detached.store(true, boost::memory_order_release);
+        return slots_[slot].owner;
+      }
+
+      void retain(int slot) {
+        slots_[slot].state.fetch_add(1, boost::memory_order_relaxed);
+      }
+
+      void release(int slot) {
+        slots_[slot].state.fetch_sub(1, boost::memory_order_release);
+      }
+  };
+
+  typedef boost::shared_ptr<FrameRing> FrameRingPtr;
+
+  const ImageBuffer& FrameHandle::operator*() const {
+    assert(valid());
+    return ring_->buffer(slot_);
+  }
+
+  const ImageBuffer* FrameHandle::operator->() const {
+    return &**this;
+  }
+
+  uint64_t FrameHandle::sequence() const {
+    assert(valid());
+    return ring_->slots_[slot_].sequence;
+  }
+
+  boost::shared_ptr<void> FrameHandle::detachStorage() const {
+    assert(valid());
+    return ring_->detach(slot_);
+  }
+
+  void FrameHandle::retain() {
+    if (valid())
+      ring_->retain(slot_);
+  }
+
+  void FrameHandle::release() {
+    if (valid())
+      ring_->release(slot_);
+  }
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: FRAME_RING_Q3M8ZK1D */
@@ -1,15 +1,22 @@
 #ifndef FREENECT_DEVICE_T01IELX0
 #define FREENECT_DEVICE_T01IELX0
 
+#include <algorithm>
+#include <deque>
 #include <boost/shared_ptr.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
 #include <boost/thread/mutex.hpp>
-#include <boost/date_time/posix_time/ptime.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <stdexcept>
 
 #include <libfreenect/libfreenect.h>
 #include <libfreenect/libfreenect_registration.h>
+#include <freenect_camera/device_backend.hpp>
+#include <freenect_camera/frame_latency.hpp>
 #include <freenect_camera/image_buffer.hpp>
+#include <freenect_camera/frame_ring.hpp>
 
 namespace freenect_camera {
 
@@ -26,12 +33,17 @@ namespace freenect_camera {
 
   class FreenectDriver;
 
-  class FreenectDevice : public boost::noncopyable {
+  class FreenectDevice : public boost::noncopyable,
+      private DeviceBackend::Listener {
 
     public:
 
-      FreenectDevice(freenect_context* driver, std::string serial) {
-        openDevice(driver, serial);
+      FreenectDevice(const DeviceBackendPtr& backend, std::string serial)
+        : synchronized_(false), unmatched_frames_(0), flush_frames_(10), flush_timeout_ms_(3000), flushing_(false),
+          last_flush_start_us_(0),
+          changes_pending_(false), last_reconfiguration_us_(0),
+          max_reconfiguration_us_(0) {
+        openDevice(backend, serial);
         flushDeviceStreams();
 
         //Initialize default variables
@@ -40,12 +52,14 @@ namespace freenect_camera {
         new_video_format_ = FREENECT_VIDEO_BAYER;
         video_buffer_.metadata.resolution = FREENECT_RESOLUTION_DUMMY;
         video_buffer_.metadata.video_format = FREENECT_VIDEO_DUMMY;
+        video_overwritten_base_ = 0;
 
         streaming_depth_ = should_stream_depth_ = false;
         new_depth_resolution_ = getDefaultDepthMode();
         new_depth_format_ = FREENECT_DEPTH_MM;
         depth_buffer_.metadata.resolution = FREENECT_RESOLUTION_DUMMY;
         depth_buffer_.metadata.depth_format = FREENECT_DEPTH_DUMMY;
+        depth_overwritten_base_ = 0;
 
         publishers_ready_ = false;
       }
@@ -56,26 +70,41 @@ namespace freenect_camera {
       }
 
       void flushDeviceStreams() {
-        device_flush_start_time_ = boost::posix_time::microsec_clock::local_time();
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        device_flush_start_us_ = frameClockUs();
         device_flush_enabled_ = true; 
-        ROS_INFO("Starting a 3s RGB and Depth stream flush.");
+        ROS_INFO("Starting an RGB and Depth stream flush.");
+        requestChanges();
       }
 
-      void openDevice(freenect_context* driver, std::string serial) {
-        if (freenect_open_device_by_camera_serial(driver, &device_, serial.c_str()) < 0) {
-          throw std::runtime_error("[ERROR] Unable to open specified kinect");
-        }
-        freenect_set_user(device_, this);
-        freenect_set_depth_callback(device_, freenectDepthCallback);
-        freenect_set_video_callback(device_, freenectVideoCallback);
-        driver_ = driver;
+      /**
+       * A flush ends once both streams delivered the given number of
+       * well-formed frames in a row, or after timeout_ms
+       */
+      void setFlushLimits(unsigned frames, unsigned timeout_ms) {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        flush_frames_ = frames;
+        flush_timeout_ms_ = timeout_ms;
+      }
+
+      /**
+       * Start of the last flush that ended with a stream running, at startup
+       * or after a timeout, on the frameClockUs() clock, 0 until there was one
+       */
+      uint64_t getLastFlushStartUs() const {
+        return last_flush_start_us_;
+      }
+
+      void openDevice(const DeviceBackendPtr& backend, std::string serial) {
+        device_ = backend;
+        device_->setListener(this);
         device_serial_ = serial;
-        registration_ = freenect_copy_registration(device_);
+        registration_ = device_->registration();
       }
 
       void shutdown() {
-        freenect_close_device(device_);
-        freenect_destroy_registration(&registration_);
+        device_->setListener(NULL);
+        device_->close();
       }
 
       /* DEVICE SPECIFIC FUNCTIONS */
@@ -114,16 +143,30 @@ namespace freenect_camera {
         return true;
       }
 
+      /** In software, see setSynchronization() */
       bool isSynchronizationSupported() const {
-        return false;
+        return true;
       }
 
       bool isSynchronized() const {
-        return false;
+        return synchronized_;
+      }
+
+      /**
+       * Pair RGB and depth frames by their device timestamps while both
+       * streams run. Pairs go to the pair callback, or one after the other to
+       * the image and depth callbacks without one. Frames that find no
+       * partner are delivered on their own a little later and counted.
+       */
+      void setSynchronization(bool on_off) {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        synchronized_ = on_off;
+        requestChanges();
       }
 
-      bool setSynchronization(bool on_off) const {
-        throw std::runtime_error("[ERROR] The kinect does not support hardware synchronization");
+      /** RGB and depth frames that found no partner while synchronized */
+      uint64_t getUnmatchedFrames() const {
+        return unmatched_frames_;
       }
 
       /**
@@ -136,19 +179,26 @@ namespace freenect_camera {
       /* CALLBACK ASSIGNMENT FUNCTIONS */
 
       template<typename T> void registerImageCallback (
-          void (T::*callback)(const ImageBuffer& image, void* cookie), 
+          void (T::*callback)(const FrameHandle& image, void* cookie), 
           T& instance, void* cookie = NULL) {
         image_callback_ = boost::bind(callback, boost::ref(instance), _1, cookie);
       }
 
       template<typename T> void registerDepthCallback (
-          void (T::*callback)(const ImageBuffer& depth_image, void* cookie), 
+          void (T::*callback)(const FrameHandle& depth_image, void* cookie), 
           T& instance, void* cookie = NULL) {
         depth_callback_ = boost::bind(callback, boost::ref(instance), _1, cookie);
       }
 
+      template<typename T> void registerImageDepthCallback (
+          void (T::*callback)(const FrameHandle& image,
+            const FrameHandle& depth_image, void* cookie),
+          T& instance, void* cookie = NULL) {
+        image_depth_callback_ = boost::bind(callback, boost::ref(instance), _1, _2, cookie);
+      }
+
       template<typename T> void registerIRCallback (
-          void (T::*callback)(const ImageBuffer& ir_image, void* cookie), 
+          void (T::*callback)(const FrameHandle& ir_image, void* cookie), 
           T& instance, void* cookie = NULL) {
         ir_callback_ = boost::bind(callback, boost::ref(instance), _1, cookie);
       }
@@ -157,6 +207,45 @@ namespace freenect_camera {
         publishers_ready_ = true;
       }
 
+      /**
+       * Use the given allocators for frame storage. Takes effect the next time
+       * a stream's buffers are (re)allocated.
+       */
+      void setFrameAllocators(const FrameAllocatorPtr& video_allocator,
+          const FrameAllocatorPtr& depth_allocator) {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        video_allocator_ = video_allocator;
+        depth_allocator_ = depth_allocator;
+      }
+
+      /** Video frames dropped because every ring slot was still in use */
+      uint64_t getVideoOverwrittenFrames() {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        return video_overwritten_base_ +
+          (video_ring_ ? video_ring_->overwrittenFrames() : 0);
+      }
+
+      /** Depth frames dropped because every ring slot was still in use */
+      uint64_t getDepthOverwrittenFrames() {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        return depth_overwritten_base_ +
+          (depth_ring_ ? depth_ring_->overwrittenFrames() : 0);
+      }
+
+      /**
+       * Time from the first of a batch of settings changes to the device
+       * running with all of them, of the last batch and the slowest one
+       */
+      uint64_t getLastReconfigurationUs() {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        return last_reconfiguration_us_;
+      }
+
+      uint64_t getMaxReconfigurationUs() {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        return max_reconfiguration_us_;
+      }
+
       /* IMAGE SETTINGS FUNCTIONS */
 
       OutputMode getImageOutputMode() {
@@ -167,6 +256,7 @@ namespace freenect_camera {
       void setImageOutputMode(OutputMode mode) {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
         new_video_resolution_ = mode;
+        requestChanges();
       }
 
       OutputMode getDefaultImageMode() const {
@@ -189,6 +279,7 @@ namespace freenect_camera {
         //std::cout << "STOP IMAGE STREAM" << std::endl;
         should_stream_video_ = 
           (isImageStreamRunning()) ? false : streaming_video_;
+        requestChanges();
       }
 
       void startImageStream() {
@@ -196,6 +287,7 @@ namespace freenect_camera {
         //std::cout << "START IMAGE STREAM" << std::endl;
         new_video_format_ = FREENECT_VIDEO_BAYER;
         should_stream_video_ = true;
+        requestChanges();
       }
 
       bool isImageStreamRunning() {
@@ -207,12 +299,14 @@ namespace freenect_camera {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
         should_stream_video_ = 
           (isIRStreamRunning()) ? false : streaming_video_;
+        requestChanges();
       }
 
       void startIRStream() {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
         new_video_format_ = FREENECT_VIDEO_IR_10BIT;
         should_stream_video_ = true;
+        requestChanges();
       }
 
       bool isIRStreamRunning() {
@@ -230,6 +324,7 @@ namespace freenect_camera {
       void setDepthOutputMode(OutputMode mode) {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
         new_depth_resolution_ = mode;
+        requestChanges();
       }
 
       OutputMode getDefaultDepthMode() const {
@@ -256,16 +351,19 @@ namespace freenect_camera {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
         new_depth_format_ = 
           (enable) ? FREENECT_DEPTH_REGISTERED : FREENECT_DEPTH_MM;
+        requestChanges();
       }
 
       void stopDepthStream() {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
         should_stream_depth_ = false;
+        requestChanges();
       }
 
       void startDepthStream() {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
         should_stream_depth_ = true;
+        requestChanges();
       }
 
       bool isDepthStreamRunning() {
@@ -273,44 +371,86 @@ namespace freenect_camera {
         return streaming_depth_ && !device_flush_enabled_;
       }
 
-      /* LIBFREENECT ASYNC CALLBACKS */
-
-      static void freenectDepthCallback(
-          freenect_device *dev, void *depth, uint32_t timestamp) {
+    private:
 
-        FreenectDevice* device = 
-            static_cast<FreenectDevice*>(freenect_get_user(dev));
-        device->depthCallback(depth);
-      }
+      friend class FreenectDriver;
 
-      static void freenectVideoCallback(
-          freenect_device *dev, void *video, uint32_t timestamp) {
+      /* BACKEND CALLBACKS, on the driver's event thread */
 
-        FreenectDevice* device = 
-            static_cast<FreenectDevice*>(freenect_get_user(dev));
-        device->videoCallback(video);
+      void depthFrameReady(void* depth, uint32_t timestamp) {
+        const uint64_t arrival_us = frameClockUs();
+        countFlushFrame(depth, depth_buffer_, timestamp, depth_last_timestamp_,
+            depth_good_frames_);
+        depthCallback(depth, timestamp, arrival_us);
       }
 
-    private:
+      void videoFrameReady(void* video, uint32_t timestamp) {
+        const uint64_t arrival_us = frameClockUs();
+        countFlushFrame(video, video_buffer_, timestamp, video_last_timestamp_,
+            video_good_frames_);
+        videoCallback(video, timestamp, arrival_us);
+      }
 
-      friend class FreenectDriver;
+      /**
+       * Counts consecutive well-formed frames of a stream: a new timestamp
+       * and not blank, checked on a sample of the frame
+       */
+      void countFlushFrame(const void* data, const ImageBuffer& format,
+          uint32_t timestamp, uint32_t& last_timestamp, unsigned& good_frames) {
+        if (!flushing_)
+          return;
+        bool blank = true;
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        const size_t size = static_cast<size_t>(format.metadata.bytes);
+        for (size_t i = 0; i < size && blank; i += 61)
+          blank = bytes[i] == 0;
+        const bool good = !blank && (good_frames == 0 || timestamp != last_timestamp);
+        good_frames = good ? good_frames + 1 : 0;
+        last_timestamp = timestamp;
+      }
 
-      freenect_context* driver_;
-      freenect_device* device_;
+      DeviceBackendPtr device_;
       std::string device_serial_;
+      /** \brief Shallow copy of the backend's, only valid while it is open */
       freenect_registration registration_;
 
-      boost::function<void(const ImageBuffer&)> image_callback_;
-      boost::function<void(const ImageBuffer&)> depth_callback_;
-      boost::function<void(const ImageBuffer&)> ir_callback_;
-
+      boost::function<void(const FrameHandle&)> image_callback_;
+      boost::function<void(const FrameHandle&)> depth_callback_;
+      boost::function<void(const FrameHandle&)> ir_callback_;
+      boost::function<void(const FrameHandle&, const FrameHandle&)> image_depth_callback_;
+
+      /** Frames of one stream waiting for a partner, only used on the event thread */
+      struct SyncQueue {
+        SyncQueue() : last_timestamp(0), interval(0) {}
+        std::deque<FrameHandle> frames;
+        uint32_t last_timestamp;
+        /** Device clock ticks between the last two frames */
+        uint32_t interval;
+      };
+
+      /** Frames each stream waits at most for its partner */
+      static const unsigned SYNC_FRAMES = 2;
+
+      boost::atomic<bool> synchronized_;
+      SyncQueue video_sync_;
+      SyncQueue depth_sync_;
+      boost::atomic<uint64_t> unmatched_frames_;
+
+      /* The *_buffer_ members only describe the current format. Frame storage
+       * lives in the rings, which are replaced whenever the format changes. */
       ImageBuffer video_buffer_;
+      FrameRingPtr video_ring_;
+      FrameAllocatorPtr video_allocator_;
+      uint64_t video_overwritten_base_;
       bool streaming_video_;
       bool should_stream_video_;
       freenect_resolution new_video_resolution_;
       freenect_video_format new_video_format_; 
 
       ImageBuffer depth_buffer_;
+      FrameRingPtr depth_ring_;
+      FrameAllocatorPtr depth_allocator_;
+      uint64_t depth_overwritten_base_;
       bool streaming_depth_;
       bool should_stream_depth_;
       freenect_resolution new_depth_resolution_;
@@ -320,23 +460,83 @@ namespace freenect_camera {
        * is ready */
       boost::recursive_mutex m_settings_;
 
-      boost::posix_time::ptime device_flush_start_time_;
+      uint64_t device_flush_start_us_;
       bool device_flush_enabled_;
-      bool publishers_ready_;
+      unsigned flush_frames_;
+      unsigned flush_timeout_ms_;
+
+      /* Only used on the event thread */
+      /** A flush executeChanges() has started and not yet ended */
+      bool flushing_;
+      unsigned video_good_frames_;
+      unsigned depth_good_frames_;
+      uint32_t video_last_timestamp_;
+      uint32_t depth_last_timestamp_;
+      /** Set after the callbacks, which the event thread calls from then on */
+      boost::atomic<bool> publishers_ready_;
+      /** Written on the event thread, read on the driver's publishing threads */
+      boost::atomic<uint64_t> last_flush_start_us_;
+
+      /** Wakes the driver's event thread when settings change */
+      boost::function<void()> wake_up_;
+      /** Settings changed since executeChanges() last applied them */
+      bool changes_pending_;
+      boost::posix_time::ptime changes_requested_time_;
+      uint64_t last_reconfiguration_us_;
+      uint64_t max_reconfiguration_us_;
+
+      /** Set by the driver once its event thread services this device */
+      void setWakeUp(const boost::function<void()>& wake_up) {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        wake_up_ = wake_up;
+      }
+
+      /** Queues the settings just changed for the event thread, m_settings_ has to be held */
+      void requestChanges() {
+        if (!changes_pending_) {
+          changes_pending_ = true;
+          changes_requested_time_ = boost::posix_time::microsec_clock::local_time();
+        }
+        if (wake_up_)
+          wake_up_();
+      }
 
+      /** Whether the backend has events for this device, i.e. a stream runs */
+      bool isStreaming() {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        return streaming_video_ || streaming_depth_;
+      }
+
+      /**
+       * Applies every pending change to both streams in one go: the streams
+       * that change are stopped, reallocated and restarted together.
+       */
       void executeChanges() {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
-        //ROS_INFO_THROTTLE(1.0, "exec changes");
+        if (!changes_pending_ && !device_flush_enabled_)
+          return;
 
         bool stop_device_flush = false;
 
+        if (device_flush_enabled_ && !flushing_) {
+          flushing_ = true;
+          video_good_frames_ = depth_good_frames_ = 0;
+        }
         if (device_flush_enabled_) {
-          boost::posix_time::ptime current_time = 
-              boost::posix_time::microsec_clock::local_time(); 
-          if ((current_time - device_flush_start_time_).total_milliseconds() > 3000) {
+          const int64_t flush_ms =
+            static_cast<int64_t>((frameClockUs() - device_flush_start_us_) / 1000);
+          const bool settled =
+            video_good_frames_ >= flush_frames_ && depth_good_frames_ >= flush_frames_;
+          if (settled || flush_ms > static_cast<int64_t>(flush_timeout_ms_)) {
             device_flush_enabled_ = false;
+            flushing_ = false;
             stop_device_flush = true;
-            ROS_INFO("Stopping device RGB and Depth stream flush.");
+            // The driver measures the time to its first published frame from here,
+            // which only comes if a stream keeps running
+            if (should_stream_video_ || should_stream_depth_)
+              last_flush_start_us_ = device_flush_start_us_;
+            ROS_INFO("Stopping device RGB and Depth stream flush after %d ms%s.",
+                static_cast<int>(flush_ms), settled ? "" : ", streams did not settle");
           }
         }
 
@@ -347,15 +547,24 @@ namespace freenect_camera {
           device_flush_enabled_ && !streaming_video_ ||
           stop_device_flush;
 
+        bool change_depth_settings = 
+          depth_buffer_.metadata.depth_format != new_depth_format_ ||
+          depth_buffer_.metadata.resolution != new_depth_resolution_ ||
+          ((streaming_depth_ != should_stream_depth_) && !device_flush_enabled_) ||
+          device_flush_enabled_ && !streaming_depth_ ||
+          stop_device_flush;
+
+        // Stop both streams before touching either
+        if (change_video_settings && streaming_video_) {
+          device_->stopVideo();
+          streaming_video_ = false;
+        }
+        if (change_depth_settings && streaming_depth_) {
+          device_->stopDepth();
+          streaming_depth_ = false;
+        }
+
         if (change_video_settings) {
-          ///ROS_INFO("change video called %i", should_stream_video_);
-          // Stop video stream
-          if (streaming_video_) {
-            //ROS_INFO("  stopping video images...");
-            freenect_stop_video(device_);
-            streaming_video_ = false;
-            return;
-          }
           // Allocate buffer for video if settings have changed
           if (video_buffer_.metadata.resolution != new_video_resolution_ ||
               video_buffer_.metadata.video_format != new_video_format_) {
@@ -369,38 +578,21 @@ namespace freenect_camera {
               allocateBufferVideo(video_buffer_, FREENECT_VIDEO_BAYER,
                   FREENECT_RESOLUTION_MEDIUM, registration_);
             }
-            freenect_set_video_mode(device_, video_buffer_.metadata);
-            freenect_set_video_buffer(device_, video_buffer_.image_buffer.get());
+            resetRing(video_ring_, video_overwritten_base_, video_buffer_,
+                video_allocator_);
+            device_->setVideoMode(video_buffer_.metadata);
+            device_->setVideoBuffer(video_ring_->writeBuffer());
             new_video_resolution_ = video_buffer_.metadata.resolution;
             new_video_format_ = video_buffer_.metadata.video_format;
           }
           // Restart stream if required
           if (should_stream_video_ || device_flush_enabled_) {
-            int rgb_out = freenect_start_video(device_);
-            //ROS_INFO("  streaming rgb images... %i", rgb_out);
+            device_->startVideo();
             streaming_video_ = true;
           }
-
-          // Don't make more than 1 change at a time
-          return;
         }
 
-        bool change_depth_settings = 
-          depth_buffer_.metadata.depth_format != new_depth_format_ ||
-          depth_buffer_.metadata.resolution != new_depth_resolution_ ||
-          ((streaming_depth_ != should_stream_depth_) && !device_flush_enabled_) ||
-          device_flush_enabled_ && !streaming_depth_ ||
-          stop_device_flush;
-
         if (change_depth_settings) {
-          //ROS_INFO("change depth called");
-          // Stop depth stream
-          if (streaming_depth_) {
-            //ROS_INFO("  stopping depth images...");
-            freenect_stop_depth(device_);
-            streaming_depth_ = false;
-            return;
-          }
           // Allocate buffer for depth if settings have changed
           if (depth_buffer_.metadata.resolution != new_depth_resolution_ ||
               depth_buffer_.metadata.depth_format != new_depth_format_) {
@@ -414,19 +606,32 @@ namespace freenect_camera {
               allocateBufferDepth(depth_buffer_, FREENECT_DEPTH_MM,
                   FREENECT_RESOLUTION_MEDIUM, registration_);
             }
-            freenect_set_depth_mode(device_, depth_buffer_.metadata);
-            freenect_set_depth_buffer(device_, depth_buffer_.image_buffer.get());
+            resetRing(depth_ring_, depth_overwritten_base_, depth_buffer_,
+                depth_allocator_);
+            device_->setDepthMode(depth_buffer_.metadata);
+            device_->setDepthBuffer(depth_ring_->writeBuffer());
             new_depth_resolution_ = depth_buffer_.metadata.resolution;
             new_depth_format_ = depth_buffer_.metadata.depth_format;
           }
           // Restart stream if required
           if (should_stream_depth_ || device_flush_enabled_) {
-            int depth_out = freenect_start_depth(device_);
-            //ROS_INFO("  streaming depth images... %i", depth_out);
+            device_->startDepth();
             streaming_depth_ = true;
-            return;
           }
         }
+
+        // Nothing pairs with the frames left waiting anymore
+        if (!synchronized_ || !streaming_video_ || !streaming_depth_) {
+          drainSyncQueue(video_sync_, false);
+          drainSyncQueue(depth_sync_, true);
+        }
+
+        if (changes_pending_) {
+          changes_pending_ = false;
+          last_reconfiguration_us_ = (boost::posix_time::microsec_clock::local_time() -
+              changes_requested_time_).total_microseconds();
+          max_reconfiguration_us_ = std::max(max_reconfiguration_us_, last_reconfiguration_us_);
+        }
       }
 
       bool _isImageModeEnabled() {
@@ -434,24 +639,120 @@ namespace freenect_camera {
         return isImageMode(video_buffer_);
       }
 
-      void depthCallback(void* depth) {
-        boost::lock_guard<boost::mutex> buffer_lock(depth_buffer_.mutex);
-        assert(depth == depth_buffer_.image_buffer.get());
-        if (publishers_ready_) {
-          depth_callback_.operator()(depth_buffer_);
+      /**
+       * Replace a stream's ring after a format change. Frames still held by
+       * consumers keep the old ring alive until they are released.
+       */
+      void resetRing(FrameRingPtr& ring, uint64_t& overwritten_base,
+          const ImageBuffer& format, const FrameAllocatorPtr& allocator) {
+        if (ring) {
+          overwritten_base += ring->overwrittenFrames();
+        }
+        // Room for the frames waiting for a partner
+        ring.reset(new FrameRing(format, allocator,
+              FrameRing::DEFAULT_SLOTS + SYNC_FRAMES));
+      }
+
+      void depthCallback(void* depth, uint32_t timestamp, uint64_t arrival_us) {
+        assert(depth == depth_ring_->writeBuffer());
+        FrameHandle frame = depth_ring_->commit(timestamp, arrival_us);
+        // Point libfreenect at the next free slot before anyone looks at the
+        // completed frame
+        device_->setDepthBuffer(depth_ring_->writeBuffer());
+        if (publishers_ready_ && frame.valid()) {
+          if (synchronized_ && streaming_video_ && isImageMode(video_buffer_)) {
+            matchFrame(frame, depth_sync_, video_sync_, true);
+          } else {
+            drainSyncQueue(depth_sync_, true);
+            deliverFrame(frame, true);
+          }
         }
       }
 
-      void videoCallback(void* video) {
-        boost::lock_guard<boost::mutex> buffer_lock(video_buffer_.mutex);
-        assert(video == video_buffer_.image_buffer.get());
-        if (publishers_ready_) {
-          if (isImageMode(video_buffer_)) {
-            image_callback_.operator()(video_buffer_);
+      void videoCallback(void* video, uint32_t timestamp, uint64_t arrival_us) {
+        assert(video == video_ring_->writeBuffer());
+        FrameHandle frame = video_ring_->commit(timestamp, arrival_us);
+        device_->setVideoBuffer(video_ring_->writeBuffer());
+        if (publishers_ready_ && frame.valid()) {
+          if (synchronized_ && streaming_depth_ && isImageMode(*frame)) {
+            matchFrame(frame, video_sync_, depth_sync_, false);
           } else {
-            ir_callback_.operator()(video_buffer_);
+            drainSyncQueue(video_sync_, false);
+            deliverFrame(frame, false);
+          }
+        }
+      }
+
+      void deliverFrame(const FrameHandle& frame, bool depth) {
+        if (depth) {
+          depth_callback_.operator()(frame);
+        } else if (isImageMode(*frame)) {
+          image_callback_.operator()(frame);
+        } else {
+          ir_callback_.operator()(frame);
+        }
+      }
+
+      /**
+       * Pairs frame with the waiting frame of the other stream closest in
+       * time, if that is less than half a frame interval away. Otherwise it
+       * waits for a partner itself.
+       */
+      void matchFrame(const FrameHandle& frame, SyncQueue& own, SyncQueue& other, bool depth) {
+        const uint32_t timestamp = frame->timestamp;
+        const uint32_t interval = timestamp - own.last_timestamp;
+        if (own.last_timestamp != 0 && interval != 0 && interval < 0x80000000u)
+          own.interval = interval;
+        own.last_timestamp = timestamp;
+
+        int best = -1;
+        uint32_t best_distance = std::max(own.interval, other.interval) / 2;
+        for (size_t i = 0; i < other.frames.size(); ++i) {
+          const int32_t difference = static_cast<int32_t>(other.frames[i]->timestamp - timestamp);
+          const uint32_t distance = difference < 0 ?
+            0u - static_cast<uint32_t>(difference) : static_cast<uint32_t>(difference);
+          if (distance <= best_distance) {
+            best = static_cast<int>(i);
+            best_distance = distance;
+          }
+        }
+
+        if (best < 0) {
+          own.frames.push_back(frame);
+          if (own.frames.size() > SYNC_FRAMES) {
+            ++unmatched_frames_;
+            deliverFrame(own.frames.front(), depth);
+            own.frames.pop_front();
           }
+          return;
+        }
+
+        // Older frames of the other stream will not find a partner anymore
+        for (int i = 0; i < best; ++i) {
+          ++unmatched_frames_;
+          deliverFrame(other.frames.front(), !depth);
+          other.frames.pop_front();
+        }
+        const FrameHandle partner = other.frames.front();
+        other.frames.pop_front();
+
+        const FrameHandle& image = depth ? partner : frame;
+        const FrameHandle& depth_image = depth ? frame : partner;
+        if (image_depth_callback_) {
+          image_depth_callback_(image, depth_image);
+        } else {
+          deliverFrame(image, false);
+          deliverFrame(depth_image, true);
+        }
+      }
+
+      void drainSyncQueue(SyncQueue& queue, bool depth) {
+        while (!queue.frames.empty()) {
+          ++unmatched_frames_;
+          deliverFrame(queue.frames.front(), depth);
+          queue.frames.pop_front();
         }
+        queue.last_timestamp = queue.interval = 0;
       }
 
   };
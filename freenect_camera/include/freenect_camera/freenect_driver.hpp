@@ -1,11 +1,26 @@
 #ifndef FREENECT_DRIVER_K8EEAIBB
 #define FREENECT_DRIVER_K8EEAIBB
 
+#include <algorithm>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
 #include <libfreenect/libfreenect.h>
 #include <freenect_camera/freenect_device.hpp>
+#include <freenect_camera/libfreenect_backend.hpp>
 
 namespace freenect_camera {
 
+  /**
+   * \class FreenectDriver
+   *
+   * \brief Opens the cameras of one backend, e.g. one libfreenect context.
+   * A single event thread services every open device, so several driver
+   * nodelets can share a nodelet manager with one camera each.
+   */
   class FreenectDriver {
 
     public:
@@ -15,27 +30,53 @@ namespace freenect_camera {
         return instance;
       }
 
+      /**
+       * Use backend instead of libfreenect, e.g. a ReplayDriverBackend. Has to
+       * be called before any device is opened.
+       */
+      void useBackend(const DriverBackendPtr& backend) {
+        boost::lock_guard<boost::mutex> lifecycle(m_lifecycle_);
+        DevicesLock lock(*this);
+        if (!devices_.empty())
+          throw std::runtime_error("[ERROR] The driver backend is already in use");
+        backend_ = backend;
+      }
+
+      /** Closes every device and the backend */
       void shutdown() {
-        thread_running_ = false;
-        freenect_thread_->join();
-        if (device_)
-          device_->shutdown();
-        device_.reset();
-        freenect_shutdown(driver_);
+        boost::lock_guard<boost::mutex> lifecycle(m_lifecycle_);
+        shutdownDevices();
       }
 
-      void updateDeviceList() {
-        device_serials_.clear();
-        freenect_device_attributes* attr_list;
-        freenect_device_attributes* item;
-        freenect_list_device_attributes(driver_, &attr_list);
-        for (item = attr_list; item != NULL; item = item->next) {
-          device_serials_.push_back(std::string(item->camera_serial));
+      /**
+       * Closes a device opened by this driver. Closing the last one stops the
+       * event thread and shuts the backend down.
+       */
+      void releaseDevice(const boost::shared_ptr<FreenectDevice>& device) {
+        boost::lock_guard<boost::mutex> lifecycle(m_lifecycle_);
+        bool last;
+        {
+          DevicesLock lock(*this);
+          std::vector<boost::shared_ptr<FreenectDevice> >::iterator it =
+            std::find(devices_.begin(), devices_.end(), device);
+          if (it == devices_.end())
+            return;
+          // The event thread does not touch the device once it is off the list
+          devices_.erase(it);
+          device->shutdown();
+          last = devices_.empty();
         }
-        freenect_free_device_attributes(attr_list);
+        if (last)
+          shutdownDevices();
+      }
+
+      void updateDeviceList() {
+        DevicesLock lock(*this);
+        device_serials_ = backend()->listSerials();
       }
 
       unsigned getNumberDevices() {
+        DevicesLock lock(*this);
         return device_serials_.size();
       }
 
@@ -65,58 +106,166 @@ namespace freenect_camera {
         return VENDOR_ID;
       }
 
-      const char* getSerialNumber(unsigned device_idx) {
-        if (device_idx < getNumberDevices())
-          return device_serials_[device_idx].c_str();
+      /** A copy, as another nodelet may update the list meanwhile */
+      std::string getSerialNumber(unsigned device_idx) {
+        DevicesLock lock(*this);
+        if (device_idx < device_serials_.size())
+          return device_serials_[device_idx];
         throw std::runtime_error("libfreenect: device idx out of range"); 
       }
 
       boost::shared_ptr<FreenectDevice> getDeviceByIndex(unsigned device_idx) {
-        return getDeviceBySerialNumber(std::string(getSerialNumber(device_idx)));
+        return getDeviceBySerialNumber(getSerialNumber(device_idx));
       }
 
+      /**
+       * Opens the device and has the event thread service it. A device can
+       * only be opened once until it is released.
+       */
       boost::shared_ptr<FreenectDevice> getDeviceBySerialNumber(std::string serial) {
-        device_.reset(new FreenectDevice(driver_, serial));
-        // start freenect thread now that we have device
-        thread_running_ = true;
-        freenect_thread_.reset(new boost::thread(boost::bind(&FreenectDriver::process, this)));
-        return device_;
+        boost::lock_guard<boost::mutex> lifecycle(m_lifecycle_);
+        // Opening with the lock held keeps the event thread out of the backend
+        // meanwhile, for at most one processEvents() timeout
+        DevicesLock lock(*this);
+        for (size_t i = 0; i < devices_.size(); ++i) {
+          if (serial == devices_[i]->getSerialNumber())
+            throw std::runtime_error("[ERROR] Device " + serial + " is already in use");
+        }
+        boost::shared_ptr<FreenectDevice> device(
+            new FreenectDevice(backend()->openDevice(serial), serial));
+        devices_.push_back(device);
+        device->setWakeUp(boost::bind(&FreenectDriver::wakeUp, this));
+        wakeUp();
+
+        // start freenect thread now that we have a device
+        if (!freenect_thread_) {
+          thread_running_ = true;
+          freenect_thread_.reset(new boost::thread(boost::bind(&FreenectDriver::process, this)));
+        }
+        return device;
       }
 
       boost::shared_ptr<FreenectDevice> getDeviceByAddress(unsigned bus, unsigned address) {
         throw std::runtime_error("[ERROR] libfreenect does not support searching for device by bus/address");
       }
 
+      /**
+       * The event loop: delivers frames, then applies each device's pending
+       * settings. Without any stream running there are no events, so it
+       * sleeps until settings change.
+       */
       void process() {
+        bool streaming = false;
         while (thread_running_) {
-          timeval t;
-          t.tv_sec = 0;
-          t.tv_usec = 10000;
-          if (freenect_process_events_timeout(driver_, &t) < 0)
-            throw std::runtime_error("freenect_process_events error");
-          if (device_)
-            device_->executeChanges();
+          {
+            boost::lock_guard<boost::mutex> lock(m_devices_);
+            if (streaming)
+              backend_->processEvents(10);
+            streaming = false;
+            for (size_t i = 0; i < devices_.size(); ++i) {
+              devices_[i]->executeChanges();
+              streaming = streaming || devices_[i]->isStreaming();
+            }
+          }
+          // Mutexes are not fair, so let a nodelet opening or releasing a
+          // device in before taking the lock again
+          while (devices_waiters_ > 0)
+            boost::this_thread::yield();
+          if (!streaming)
+            waitForChanges();
         }
       }
 
       void enableDebug() {
-        freenect_set_log_level(driver_, FREENECT_LOG_SPEW);
+        DevicesLock lock(*this);
+        backend()->enableDebug();
       }
 
     private:
-      FreenectDriver() {
-        freenect_init(&driver_, NULL);
-        freenect_set_log_level(driver_, FREENECT_LOG_FATAL); // Prevent's printing stuff to the screen
-        freenect_select_subdevices(driver_, (freenect_device_flags)(FREENECT_DEVICE_CAMERA));
+      FreenectDriver() : devices_waiters_(0), wake_up_pending_(false) {
+        thread_running_ = false;
+      }
+
+      /** Takes m_devices_ ahead of the event thread */
+      class DevicesLock {
+        public:
+          explicit DevicesLock(FreenectDriver& driver) : driver_(driver) {
+            ++driver_.devices_waiters_;
+            driver_.m_devices_.lock();
+            --driver_.devices_waiters_;
+          }
+
+          ~DevicesLock() {
+            driver_.m_devices_.unlock();
+          }
+
+        private:
+          FreenectDriver& driver_;
+      };
+
+      /** libfreenect unless another backend was set first, m_devices_ has to be held */
+      const DriverBackendPtr& backend() {
+        if (!backend_)
+          backend_.reset(new LibfreenectDriverBackend());
+        return backend_;
+      }
+
+      /** Needs m_lifecycle_ */
+      void shutdownDevices() {
+        std::vector<boost::shared_ptr<FreenectDevice> > devices;
+        {
+          DevicesLock lock(*this);
+          devices.swap(devices_);
+        }
+        stopThread();
+        for (size_t i = 0; i < devices.size(); ++i)
+          devices[i]->shutdown();
+
+        DevicesLock lock(*this);
+        if (backend_)
+          backend_->shutdown();
+        // A device opened later gets a fresh backend
+        backend_.reset();
+      }
+
+      /** Called by the devices whenever their settings change */
+      void wakeUp() {
+        boost::lock_guard<boost::mutex> lock(m_wake_up_);
+        wake_up_pending_ = true;
+        wake_up_.notify_one();
+      }
+
+      void waitForChanges() {
+        boost::unique_lock<boost::mutex> lock(m_wake_up_);
+        while (!wake_up_pending_ && thread_running_)
+          wake_up_.wait(lock);
+        wake_up_pending_ = false;
+      }
+
+      void stopThread() {
         thread_running_ = false;
+        wakeUp();
+        if (freenect_thread_)
+          freenect_thread_->join();
+        freenect_thread_.reset();
       }
 
-      freenect_context* driver_;
+      DriverBackendPtr backend_;
       std::vector<std::string> device_serials_;
       boost::shared_ptr<boost::thread> freenect_thread_;
-      boost::shared_ptr<FreenectDevice> device_;
+      std::vector<boost::shared_ptr<FreenectDevice> > devices_;
+
+      /** Orders opening, releasing and shutting down devices */
+      boost::mutex m_lifecycle_;
+      /** Guards the backend and the device lists, held by the event thread
+       * while it processes events */
+      boost::mutex m_devices_;
+      boost::atomic<int> devices_waiters_;
+      boost::atomic<bool> thread_running_;
 
-      bool thread_running_;
+      boost::mutex m_wake_up_;
+      boost::condition_variable wake_up_;
+      bool wake_up_pending_;
   };
 
 }
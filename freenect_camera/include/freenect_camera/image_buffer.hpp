@@ -2,8 +2,7 @@
 #define IMAGE_BUFFER_6RYGHM2V
 
 #include <stdexcept>
-#include <boost/thread/mutex.hpp>
-#include <boost/shared_ptr.hpp>
+#include <boost/shared_array.hpp>
 #include <boost/lexical_cast.hpp>
 
 #include <libfreenect/libfreenect.h>
@@ -20,12 +19,15 @@ namespace freenect_camera {
    * image over ROS channels
    */
   struct ImageBuffer {
-    boost::mutex mutex;
     boost::shared_array<unsigned char> image_buffer;
     int valid;
     freenect_frame_mode metadata;
     float focal_length;
     bool is_registered;
+    /** Device clock when the frame was captured, as libfreenect reports it */
+    uint32_t timestamp;
+    /** frameClockUs() when the frame arrived from the device */
+    uint64_t arrival_us;
   };
 
   
@@ -51,7 +53,8 @@ namespace freenect_camera {
   }
 
   /**
-   * Reallocate the video buffer if the video format or resolution changes
+   * Fill in the video buffer metadata if the video format or resolution changes.
+   * Storage for the frames themselves is owned by the FrameRing.
    */
   void allocateBufferVideo(
       ImageBuffer& buffer,
@@ -59,15 +62,6 @@ namespace freenect_camera {
       const freenect_resolution& resolution,
       const freenect_registration& registration) {
 
-    // Obtain a lock on the buffer. This is mostly for debugging, as allocate
-    // buffer should only be called when the buffer is not being used by the
-    // freenect thread
-    boost::lock_guard<boost::mutex> buffer_lock(buffer.mutex);
-
-    // Deallocate the buffer incase an exception happens (the buffer should no
-    // longer be valid)
-    buffer.image_buffer.reset();
-
     switch (format) {
       case FREENECT_VIDEO_RGB:
       case FREENECT_VIDEO_BAYER:
@@ -96,8 +90,7 @@ namespace freenect_camera {
             boost::lexical_cast<std::string>(format));
     }
 
-    // All is good, reallocate the buffer and calculate other pieces of info
-    buffer.image_buffer.reset(new unsigned char[buffer.metadata.bytes]);
+    // All is good, calculate other pieces of info
     switch(format) {
       case FREENECT_VIDEO_RGB:
       case FREENECT_VIDEO_BAYER:
@@ -117,7 +110,8 @@ namespace freenect_camera {
   }
 
   /**
-   * Reallocate the depth buffer if the depth format or resolution changes
+   * Fill in the depth buffer metadata if the depth format or resolution changes.
+   * Storage for the frames themselves is owned by the FrameRing.
    */
   void allocateBufferDepth(
       ImageBuffer& buffer,
@@ -125,15 +119,6 @@ namespace freenect_camera {
       const freenect_resolution& resolution,
       const freenect_registration& registration) {
 
-    // Obtain a lock on the buffer. This is mostly for debugging, as allocate
-    // buffer should only be called when the buffer is not being used by the
-    // freenect thread
-    boost::lock_guard<boost::mutex> buffer_lock(buffer.mutex);
-
-    // Deallocate the buffer incase an exception happens (the buffer should no
-    // longer be valid)
-    buffer.image_buffer.reset();
-
     switch (format) {
       case FREENECT_DEPTH_11BIT:
       case FREENECT_DEPTH_10BIT:
@@ -161,8 +146,7 @@ namespace freenect_camera {
             boost::lexical_cast<std::string>(format));
     }
 
-    // All is good, reallocate the buffer and calculate other pieces of info
-    buffer.image_buffer.reset(new unsigned char[buffer.metadata.bytes]);
+    // All is good, calculate other pieces of info
     switch(format) {
       case FREENECT_DEPTH_11BIT:
       case FREENECT_DEPTH_10BIT:
@@ -0,0 +1,160 @@
+#ifndef LIBFREENECT_BACKEND_M4XK9TQE
+#define LIBFREENECT_BACKEND_M4XK9TQE
+
+#include <stdexcept>
+#include <boost/noncopyable.hpp>
+
+#include <freenect_camera/device_backend.hpp>
+
+namespace freenect_camera {
+
+  /**
+   * \class LibfreenectDeviceBackend
+   *
+   * \brief A Kinect on USB, driven by libfreenect
+   */
+  class LibfreenectDeviceBackend : public DeviceBackend, private boost::noncopyable {
+
+    public:
+
+      LibfreenectDeviceBackend(freenect_context* context, const std::string& serial)
+        : device_(NULL), listener_(NULL) {
+        if (freenect_open_device_by_camera_serial(context, &device_, serial.c_str()) < 0) {
+          throw std::runtime_error("[ERROR] Unable to open specified kinect");
+        }
+        freenect_set_user(device_, this);
+        freenect_set_depth_callback(device_, freenectDepthCallback);
+        freenect_set_video_callback(device_, freenectVideoCallback);
+        registration_ = freenect_copy_registration(device_);
+      }
+
+      ~LibfreenectDeviceBackend() {
+        close();
+      }
+
+      void setListener(Listener* listener) {
+        listener_ = listener;
+      }
+
+      const freenect_registration& registration() const {
+        return registration_;
+      }
+
+      void setVideoMode(const freenect_frame_mode& mode) {
+        freenect_set_video_mode(device_, mode);
+      }
+
+      void setVideoBuffer(void* buffer) {
+        freenect_set_video_buffer(device_, buffer);
+      }
+
+      void startVideo() {
+        freenect_start_video(device_);
+      }
+
+      void stopVideo() {
+        freenect_stop_video(device_);
+      }
+
+      void setDepthMode(const freenect_frame_mode& mode) {
+        freenect_set_depth_mode(device_, mode);
+      }
+
+      void setDepthBuffer(void* buffer) {
+        freenect_set_depth_buffer(device_, buffer);
+      }
+
+      void startDepth() {
+        freenect_start_depth(device_);
+      }
+
+      void stopDepth() {
+        freenect_stop_depth(device_);
+      }
+
+      void close() {
+        if (device_ == NULL)
+          return;
+        freenect_close_device(device_);
+        freenect_destroy_registration(&registration_);
+        device_ = NULL;
+      }
+
+    private:
+
+      static void freenectDepthCallback(
+          freenect_device *dev, void *depth, uint32_t timestamp) {
+        LibfreenectDeviceBackend* backend =
+            static_cast<LibfreenectDeviceBackend*>(freenect_get_user(dev));
+        if (backend->listener_)
+          backend->listener_->depthFrameReady(depth, timestamp);
+      }
+
+      static void freenectVideoCallback(
+          freenect_device *dev, void *video, uint32_t timestamp) {
+        LibfreenectDeviceBackend* backend =
+            static_cast<LibfreenectDeviceBackend*>(freenect_get_user(dev));
+        if (backend->listener_)
+          backend->listener_->videoFrameReady(video, timestamp);
+      }
+
+      freenect_device* device_;
+      freenect_registration registration_;
+      Listener* listener_;
+  };
+
+  /**
+   * \class LibfreenectDriverBackend
+   *
+   * \brief Kinects on USB, driven by one libfreenect context
+   */
+  class LibfreenectDriverBackend : public DriverBackend {
+
+    public:
+
+      LibfreenectDriverBackend() {
+        freenect_init(&context_, NULL);
+        freenect_set_log_level(context_, FREENECT_LOG_FATAL); // Prevent's printing stuff to the screen
+        freenect_select_subdevices(context_, (freenect_device_flags)(FREENECT_DEVICE_CAMERA));
+      }
+
+      std::vector<std::string> listSerials() {
+        std::vector<std::string> serials;
+        freenect_device_attributes* attr_list;
+        freenect_device_attributes* item;
+        freenect_list_device_attributes(context_, &attr_list);
+        for (item = attr_list; item != NULL; item = item->next) {
+          serials.push_back(std::string(item->camera_serial));
+        }
+        freenect_free_device_attributes(attr_list);
+        return serials;
+      }
+
+      DeviceBackendPtr openDevice(const std::string& serial) {
+        return DeviceBackendPtr(new LibfreenectDeviceBackend(context_, serial));
+      }
+
+      void processEvents(int timeout_ms) {
+        timeval t;
+        t.tv_sec = timeout_ms / 1000;
+        t.tv_usec = (timeout_ms % 1000) * 1000;
+        if (freenect_process_events_timeout(context_, &t) < 0)
+          throw std::runtime_error("freenect_process_events error");
+      }
+
+      void enableDebug() {
+        freenect_set_log_level(context_, FREENECT_LOG_SPEW);
+      }
+
+      void shutdown() {
+        freenect_shutdown(context_);
+      }
+
+    private:
+
+      freenect_context* context_;
+  };
+
+}
+
+#endif /* end of include guard: LIBFREENECT_BACKEND_M4XK9TQE */
@@ -0,0 +1,216 @@
+#ifndef WORK_STEALING_POOL_R5T9XB2E
+#define WORK_STEALING_POOL_R5T9XB2E
+
+#include <algorithm>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace freenect_camera {
+
+  /**
+   * \class WorkStealingPool
+   *
+   * \brief Small pool of threads for splitting per-frame work, like the face
+   * filter stages, across idle cores.
+   *
+   * parallelFor() cuts [0, count) into chunks and deals them out to one queue
+   * per thread, the calling thread included. Each thread works through its own
+   * queue from the front and, once that is empty, steals from the back of the
+   * others, so uneven chunks even out. The call returns when every chunk is
+   * done. Calls from several threads are run one after the other. Nothing is
+   * allocated once the queues have grown to the largest chunk count used.
+   */
+  class WorkStealingPool : public boost::noncopyable {
+
+    public:
+
+      explicit WorkStealingPool(unsigned worker_count)
+        : queues_(worker_count + 1), generation_(0), stopping_(false) {
+        for (unsigned i = 0; i < worker_count; ++i) {
+          workers_.create_thread(boost::bind(&WorkStealingPool::run, this, i + 1));
+        }
+      }
+
+      ~WorkStealingPool() {
+        {
+          boost::lock_guard<boost::mutex> lock(mutex_);
+          stopping_ = true;
+        }
+        wake_.notify_all();
+        workers_.join_all();
+      }
+
+      /** Threads taking part in parallelFor(), including the caller */
+      unsigned size() const {
+        return queues_.size();
+      }
+
+      /**
+       * Call task(begin, end) for chunks of at most grain indices covering
+       * [0, count), and wait until all of them returned.
+       */
+      template <typename Task>
+      void parallelFor(unsigned count, unsigned grain, const Task& task) {
+        if (count == 0) {
+          return;
+        }
+        if (grain == 0) {
+          grain = 1;
+        }
+        unsigned chunks = (count + grain - 1) / grain;
+        if (chunks == 1 || queues_.size() == 1) {
+          task(0, count);
+          return;
+        }
+
+        boost::lock_guard<boost::mutex> call_lock(call_mutex_);
+        Job job;
+        job.task = &task;
+        job.invoke = &invokeTask<Task>;
+        job.remaining.store(chunks, boost::memory_order_relaxed);
+
+        // Contiguous chunks per queue, so neighbouring data stays on one thread
+        // unless it gets stolen
+        for (unsigned q = 0; q < queues_.size(); ++q) {
+          unsigned first = chunks * q / queues_.size();
+          unsigned last = chunks * (q + 1) / queues_.size();
+          Queue& queue = queues_[q];
+          boost::lock_guard<boost::mutex> lock(queue.mutex);
+          queue.chunks.resize(std::max<size_t>(queue.chunks.size(), last - first));
+          for (unsigned c = first; c < last; ++c) {
+            Chunk& chunk = queue.chunks[c - first];
+            chunk.job = &job;
+            chunk.begin = c * grain;
+            chunk.end = std::min(count, (c + 1) * grain);
+          }
+          queue.head = 0;
+          queue.tail = last - first;
+        }
+        {
+          boost::lock_guard<boost::mutex> lock(mutex_);
+          ++generation_;
+        }
+        wake_.notify_all();
+
+        work(0);
+
+        // Chunks stolen from us may still be running elsewhere
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        while (job.remaining.load(boost::memory_order_acquire) != 0) {
+          done_.wait(lock);
+        }
+      }
+
+    private:
+
+      struct Job {
+        const void* task;
+        void (*invoke)(const void* task, unsigned begin, unsigned end);
+        boost::atomic<unsigned> remaining;
+      };
+
+      struct Chunk {
+        Job* job;
+        unsigned begin;
+        unsigned end;
+      };
+
+      struct Queue {
+        Queue() : head(0), tail(0) {}
+        Queue(const Queue&) : head(0), tail(0) {}
+
+        boost::mutex mutex;
+        /** Pending chunks are [head, tail) */
+        std::vector<Chunk> chunks;
+        size_t head;
+        size_t tail;
+      };
+
+      std::vector<Queue> queues_;
+      boost::thread_group workers_;
+      boost::mutex call_mutex_;
+      boost::mutex mutex_;
+      boost::condition_variable wake_;
+      boost::condition_variable done_;
+      /** Bumped for every parallelFor(), so sleeping workers know there is work */
+      uint64_t generation_;
+      bool stopping_;
+
+      template <typename Task>
+      static void invokeTask(const void* task, unsigned begin, unsigned end) {
+        (*static_cast<const Task*>(task))(begin, end);
+      }
+
+      bool popFront(unsigned q, Chunk& chunk) {
+        Queue& queue = queues_[q];
+        boost::lock_guard<boost::mutex> lock(queue.mutex);
+        if (queue.head == queue.tail) {
+          return false;
+        }
+        chunk = queue.chunks[queue.head++];
+        return true;
+      }
+
+      bool popBack(unsigned q, Chunk& chunk) {
+        Queue& queue = queues_[q];
+        boost::lock_guard<boost::mutex> lock(queue.mutex);
+        if (queue.head == queue.tail) {
+          return false;
+        }
+        chunk = queue.chunks[--queue.tail];
+        return true;
+      }
+
+      /** Run chunks until no queue has any left */
+      void work(unsigned self) {
+        Chunk chunk;
+        for (;;) {
+          bool found = popFront(self, chunk);
+          for (unsigned i = 1; !found && i < queues_.size(); ++i) {
+            found = popBack((self + i) % queues_.size(), chunk);
+          }
+          if (!found) {
+            return;
+          }
+
+          // The job outlives all of its chunks, so it is safe to use until
+          // remaining drops to zero
+          Job* job = chunk.job;
+          job->invoke(job->task, chunk.begin, chunk.end);
+          if (job->remaining.fetch_sub(1, boost::memory_order_acq_rel) == 1) {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            done_.notify_all();
+          }
+        }
+      }
+
+      void run(unsigned self) {
+        uint64_t seen = 0;
+        for (;;) {
+          {
+            boost::unique_lock<boost::mutex> lock(mutex_);
+            while (!stopping_ && generation_ == seen) {
+              wake_.wait(lock);
+            }
+            if (stopping_) {
+              return;
+            }
+            seen = generation_;
+          }
+          work(self);
+        }
+      }
+  };
+
+  typedef boost::shared_ptr<WorkStealingPool> WorkStealingPoolPtr;
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: WORK_STEALING_POOL_R5T9XB2E */
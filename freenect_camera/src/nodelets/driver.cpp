@@ -39,9 +39,10 @@
 #include "driver.h" /// @todo Get rid of this header entirely?
 #include <sensor_msgs/image_encodings.h>
 #include <sensor_msgs/distortion_models.h>
+#include <sensor_msgs/PointCloud2.h>
 #include <boost/algorithm/string/replace.hpp>
 #include <log4cxx/logger.h>
-#include "face_filter.h"
+#include "image_pool.h"
 
 using namespace std;
 namespace freenect_camera {
@@ -56,8 +57,13 @@ DriverNodelet::~DriverNodelet ()
   close_diagnostics_ = true;
   diagnostics_thread_.join();
 
+  // Frames posted from now on are never published
+  frame_executor_.stop();
+
+  // Other driver nodelets may still be using the driver's other devices
   FreenectDriver& driver = FreenectDriver::getInstance ();
-  driver.shutdown();
+  if (device_)
+    driver.releaseDevice(device_);
 
   /// @todo Test watchdog timer for race conditions. May need to use a separate callback queue
   /// controlled by the driver nodelet.
@@ -88,12 +94,80 @@ void DriverNodelet::onInitImpl ()
   ros::NodeHandle projector_nh(nh, "projector");
 
   rgb_frame_counter_ = depth_frame_counter_ = ir_frame_counter_ = 0;
+  measured_flush_start_us_ = first_publish_us_ = 0;
   publish_rgb_ = publish_ir_ = publish_depth_ = true;
 
   // Check to see if we should enable debugging messages in libfreenect
   // libfreenect_debug_ should be set before calling setupDevice
   param_nh.param("debug" , libfreenect_debug_, false);
 
+  // Publish frames from the buffers libfreenect wrote them into, without a copy
+  param_nh.param("zero_copy", zero_copy_, false);
+
+  // Pair RGB and depth frames by device timestamp and publish them with one stamp
+  param_nh.param("synchronize_rgb_depth", synchronize_rgb_depth_, false);
+
+  // Publish point clouds from the driver, in place of the point cloud nodelets
+  param_nh.param("publish_points", publish_points_, false);
+
+  // Publishing and depth post-processing run on their own threads, so the libfreenect
+  // thread is free to service USB transfers
+  int num_publish_threads;
+  param_nh.param("num_publish_threads", num_publish_threads, 2);
+  rgb_stream_   = frame_executor_.addStream(boost::bind(&DriverNodelet::publishRgbFrame, this, _1));
+  depth_stream_ = frame_executor_.addStream(boost::bind(&DriverNodelet::publishDepthFrame, this, _1));
+  ir_stream_    = frame_executor_.addStream(boost::bind(&DriverNodelet::publishIrFrame, this, _1));
+  frame_executor_.start(std::max(num_publish_threads, 0));
+
+  // Only rebin the pixels that changed since the previous depth frame. That needs the
+  // general face filter.
+  bool incremental_face_filter;
+  param_nh.param("incremental_face_filter", incremental_face_filter, false);
+  // Use the face filter built at compile time for the default parameters, unless the
+  // incremental mode or tracing needs the general one
+  bool fixed_face_filter;
+  param_nh.param("fixed_face_filter", fixed_face_filter, false);
+  // Record the face filter's intermediate data into this file, tracing needs the general
+  // face filter too
+  std::string face_filter_trace_file;
+  param_nh.param("face_filter_trace_file", face_filter_trace_file, std::string());
+  if (!face_filter_trace_file.empty())
+  {
+    try
+    {
+      face_filter_trace_.reset(new FlightRecorder(face_filter_trace_file));
+      NODELET_INFO("Recording face filter traces to %s", face_filter_trace_file.c_str());
+    }
+    catch (std::runtime_error* e)
+    {
+      // Like the face filter, the recorder throws by pointer. Run on without tracing.
+      NODELET_ERROR("Could not record face filter traces. Reason: %s", e->what());
+      delete e;
+    }
+  }
+  if (incremental_face_filter || face_filter_trace_)
+  {
+    boost::shared_ptr<FaceFilterHistogramTransform> face_filter(
+        new FaceFilterHistogramTransform(30, 20, 4000, face_filter_trace_.get()));
+    face_filter->SetIncremental(incremental_face_filter);
+    face_filter_ = face_filter;
+  }
+  else
+  {
+    face_filter_ = CreateFaceFilterTransform(30, 20, 4000, fixed_face_filter);
+  }
+
+  // Extra threads the face filter (and other per-frame work) can split its stages over,
+  // on top of the publishing thread that runs it
+  int num_worker_threads;
+  param_nh.param("num_worker_threads", num_worker_threads, 2);
+  if (num_worker_threads > 0)
+  {
+    worker_pool_.reset(new WorkStealingPool(num_worker_threads));
+    face_filter_parallel_for_.reset(new PoolParallelFor(worker_pool_));
+    face_filter_->SetParallelFor(face_filter_parallel_for_.get());
+  }
+
   // Initialize the sensor, but don't start any streams yet. That happens in the connection callbacks.
   updateModeMaps();
   setupDevice();
@@ -182,6 +256,8 @@ void DriverNodelet::onInitImpl ()
     std::string hardware_id = std::string(device_->getProductName()) + "-" +
         std::string(device_->getSerialNumber());
     diagnostic_updater_->setHardwareID(hardware_id);
+    diagnostic_updater_->add("Frame Buffers", this, &DriverNodelet::frameBufferDiagnostics);
+    diagnostic_updater_->add("Frame Latency", this, &DriverNodelet::frameLatencyDiagnostics);
     
     // Asus Xtion PRO does not have an RGB camera
     if (device_->hasImageStream())
@@ -220,9 +296,18 @@ void DriverNodelet::onInitImpl ()
       }
 
       pub_projector_info_ = projector_nh.advertise<sensor_msgs::CameraInfo>("camera_info", 1, rssc, rssc);
+
+      // Organized XYZ points of the depth image, only computed while subscribed
+      if (publish_points_)
+        pub_points_ = depth_nh.advertise<sensor_msgs::PointCloud2>("points", 1, rssc, rssc);
       
       if (device_->isDepthRegistrationSupported()) {
         pub_depth_registered_ = depth_registered_it.advertiseCamera("image_raw", 1, itssc, itssc, rssc, rssc);
+        // XYZRGB points of registered depth and the RGB frames paired with it, which needs both streams
+        if (publish_points_ && device_->hasImageStream()) {
+          ros::SubscriberStatusCallback pssc = boost::bind(&DriverNodelet::pointsConnectCb, this);
+          pub_points_registered_ = depth_registered_nh.advertise<sensor_msgs::PointCloud2>("points", 1, pssc, pssc);
+        }
       }
     }
   }
@@ -248,11 +333,87 @@ void DriverNodelet::updateDiagnostics() {
   }
 }
 
+void DriverNodelet::frameBufferDiagnostics(diagnostic_updater::DiagnosticStatusWrapper& stat)
+{
+  uint64_t video_overwritten = device_->getVideoOverwrittenFrames();
+  uint64_t depth_overwritten = device_->getDepthOverwrittenFrames();
+  if (video_overwritten > 0 || depth_overwritten > 0)
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN, "Frames dropped because every buffer was in use");
+  else
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "No frames dropped");
+  stat.add("Overwritten video frames", video_overwritten);
+  stat.add("Overwritten depth frames", depth_overwritten);
+  stat.add("Stale rgb frames dropped", frame_executor_.droppedFrames(rgb_stream_));
+  stat.add("Stale depth frames dropped", frame_executor_.droppedFrames(depth_stream_));
+  stat.add("Stale ir frames dropped", frame_executor_.droppedFrames(ir_stream_));
+  stat.add("Unmatched RGB-D frames", device_->getUnmatchedFrames());
+  stat.add("Last reconfiguration (ms)", device_->getLastReconfigurationUs() / 1000.0);
+  stat.add("Slowest reconfiguration (ms)", device_->getMaxReconfigurationUs() / 1000.0);
+  stat.add("Time to first published frame after flush (ms)", first_publish_us_ / 1000.0);
+  if (face_filter_trace_)
+  {
+    stat.add("Face filter traces recorded", face_filter_trace_->Recorded());
+    stat.add("Face filter traces dropped", face_filter_trace_->Dropped());
+  }
+}
+
+namespace
+{
+  void addLatency(diagnostic_updater::DiagnosticStatusWrapper& stat, const std::string& name,
+                  const LatencyHistogram& latency)
+  {
+    if (latency.count() == 0)
+      return;
+    stat.addf(name + " p50/p99/max (ms)", "%.1f / %.1f / %.1f", latency.percentile(0.5) / 1000.0,
+              latency.percentile(0.99) / 1000.0, latency.max() / 1000.0);
+  }
+
+  void addLatencies(diagnostic_updater::DiagnosticStatusWrapper& stat, const std::string& stream,
+                    const FrameLatencies& latencies)
+  {
+    addLatency(stat, stream + " callback", latencies.callback);
+    addLatency(stat, stream + " processed", latencies.processed);
+    addLatency(stat, stream + " published", latencies.published);
+  }
+}
+
+void DriverNodelet::frameLatencyDiagnostics(diagnostic_updater::DiagnosticStatusWrapper& stat)
+{
+  // From the arrival of each frame at the driver, for all frames since the start
+  stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "Latency since frame arrival");
+  addLatencies(stat, "RGB", rgb_latency_);
+  addLatencies(stat, "Depth", depth_latency_);
+  addLatencies(stat, "IR", ir_latency_);
+}
+
 void DriverNodelet::setupDevice ()
 {
   // Initialize the openni device
   FreenectDriver& driver = FreenectDriver::getInstance();
 
+  // Play recorded frame files instead of using a Kinect, e.g. for load tests on machines
+  // without one. The device then has the serial number "replay".
+  std::string replay_depth_frames, replay_video_frames;
+  getPrivateNodeHandle().param("replay_depth_frames", replay_depth_frames, std::string());
+  getPrivateNodeHandle().param("replay_video_frames", replay_video_frames, std::string());
+  if (!replay_depth_frames.empty())
+  {
+    bool replay_real_time, replay_loop;
+    getPrivateNodeHandle().param("replay_real_time", replay_real_time, true);
+    getPrivateNodeHandle().param("replay_loop", replay_loop, true);
+    try {
+      driver.useBackend(boost::make_shared<ReplayDriverBackend>(replay_depth_frames,
+          replay_video_frames, replay_real_time, replay_loop));
+    }
+    catch (exception& e)
+    {
+      NODELET_FATAL ("Could not replay frames. Reason: %s", e.what ());
+      exit (-1);
+    }
+    NODELET_INFO ("Replaying frames %s%s%s", replay_depth_frames.c_str (),
+                  replay_video_frames.empty () ? "" : " and ", replay_video_frames.c_str ());
+  }
+
   // Enable debugging in libfreenect if requested
   if (libfreenect_debug_)
     driver.enableDebug();
@@ -274,7 +435,7 @@ void DriverNodelet::setupDevice ()
                    deviceIdx + 1, driver.getBus(deviceIdx), driver.getAddress(deviceIdx),
                    driver.getProductName(deviceIdx), driver.getProductID(deviceIdx),
                    driver.getVendorName(deviceIdx), driver.getVendorID(deviceIdx),
-                   driver.getSerialNumber(deviceIdx));
+                   driver.getSerialNumber(deviceIdx).c_str());
     }
 
     try {
@@ -323,9 +484,24 @@ void DriverNodelet::setupDevice ()
   NODELET_INFO ("Opened '%s' on bus %d:%d with serial number '%s'", device_->getProductName (),
                 device_->getBus (), device_->getAddress (), device_->getSerialNumber ());
 
+  // The flush at startup and after a timeout ends once both streams settled
+  int flush_frames;
+  double flush_timeout;
+  getPrivateNodeHandle().param("flush_frames", flush_frames, 10);
+  getPrivateNodeHandle().param("flush_timeout", flush_timeout, 3.0);
+  device_->setFlushLimits(std::max(flush_frames, 0),
+                          static_cast<unsigned>(std::max(flush_timeout, 0.0) * 1000));
+
+  if (zero_copy_)
+  {
+    device_->setFrameAllocators(boost::make_shared<ImageMessagePool>(),
+                                boost::make_shared<ImageMessagePool>());
+  }
+
   device_->registerImageCallback(&DriverNodelet::rgbCb,   *this);
   device_->registerDepthCallback(&DriverNodelet::depthCb, *this);
   device_->registerIRCallback   (&DriverNodelet::irCb,    *this);
+  device_->registerImageDepthCallback(&DriverNodelet::rgbDepthCb, *this);
 }
 
 void DriverNodelet::rgbConnectCb()
@@ -333,7 +509,7 @@ void DriverNodelet::rgbConnectCb()
   //std::cout << "rgb connect cb called";
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   //std::cout << "..." << std::endl;
-  bool need_rgb = pub_rgb_.getNumSubscribers() > 0;
+  bool need_rgb = pub_rgb_.getNumSubscribers() > 0 || needColoredPoints();
   //std::cout << "  need_rgb: " << need_rgb << std::endl;
   
   if (need_rgb && !device_->isImageStreamRunning())
@@ -371,8 +547,9 @@ void DriverNodelet::depthConnectCb()
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   //std::cout << "..." << std::endl;
   /// @todo pub_projector_info_? Probably also subscribed to a depth image if you need it
-  bool need_depth =
-    device_->isDepthRegistered() ? pub_depth_registered_.getNumSubscribers() > 0 : pub_depth_.getNumSubscribers() > 0;
+  bool need_depth = device_->isDepthRegistered() ?
+    pub_depth_registered_.getNumSubscribers() > 0 || pub_points_registered_.getNumSubscribers() > 0 :
+    pub_depth_.getNumSubscribers() > 0 || pub_points_.getNumSubscribers() > 0;
   /// @todo Warn if requested topics don't agree with Freenect registration setting
   //std::cout << "  need_depth: " << need_depth << std::endl;
 
@@ -391,6 +568,24 @@ void DriverNodelet::depthConnectCb()
   //std::cout << "depth connect cb end..." << std::endl;
 }
 
+void DriverNodelet::pointsConnectCb()
+{
+  rgbConnectCb();
+  depthConnectCb();
+
+  // The streams may have been running already, for the images
+  boost::lock_guard<boost::mutex> lock(connect_mutex_);
+  if (needColoredPoints())
+    startSynchronization();
+  else if (!synchronize_rgb_depth_)
+    stopSynchronization();
+}
+
+bool DriverNodelet::needColoredPoints() const
+{
+  return device_->isDepthRegistered() && pub_points_registered_.getNumSubscribers() > 0;
+}
+
 void DriverNodelet::irConnectCb()
 {
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
@@ -433,8 +628,9 @@ void DriverNodelet::checkFrameCounters()
     }
 }
 
-void DriverNodelet::rgbCb(const ImageBuffer& image, void* cookie)
+void DriverNodelet::rgbCb(const FrameHandle& image, void* cookie)
 {
+  rgb_latency_.callback.recordSince(image->arrival_us);
   ros::Time time = ros::Time::now () + ros::Duration(config_.image_time_offset);
   rgb_time_stamp_ = time; // for watchdog
 
@@ -444,19 +640,20 @@ void DriverNodelet::rgbCb(const ImageBuffer& image, void* cookie)
       rgb_frame_counter_++;
       checkFrameCounters();
       publish = publish_rgb_;
+      publish_rgb_ = false;
 
       if (publish)
           rgb_frame_counter_ = 0; // Reset counter if we publish this message to avoid under-throttling
   }
 
+  // Only hand the frame off, the executor publishes it
   if (publish)
-      publishRgbImage(image, time);
-
-  publish_rgb_ = false;
+      frame_executor_.post(rgb_stream_, StampedFrame(image, time));
 }
 
-void DriverNodelet::depthCb(const ImageBuffer& depth_image, void* cookie)
+void DriverNodelet::depthCb(const FrameHandle& depth_image, void* cookie)
 {
+  depth_latency_.callback.recordSince(depth_image->arrival_us);
   ros::Time time = ros::Time::now () + ros::Duration(config_.depth_time_offset);
   depth_time_stamp_ = time; // for watchdog
 
@@ -466,19 +663,19 @@ void DriverNodelet::depthCb(const ImageBuffer& depth_image, void* cookie)
       depth_frame_counter_++;
       checkFrameCounters();
       publish = publish_depth_;
+      publish_depth_ = false;
 
       if (publish)
           depth_frame_counter_ = 0; // Reset counter if we publish this message to avoid under-throttling
   }
 
   if (publish)
-      publishDepthImage(depth_image, time);
-
-  publish_depth_ = false;
+      frame_executor_.post(depth_stream_, StampedFrame(depth_image, time));
 }
 
-void DriverNodelet::irCb(const ImageBuffer& ir_image, void* cookie)
+void DriverNodelet::irCb(const FrameHandle& ir_image, void* cookie)
 {
+  ir_latency_.callback.recordSince(ir_image->arrival_us);
   ros::Time time = ros::Time::now() + ros::Duration(config_.depth_time_offset);
   ir_time_stamp_ = time; // for watchdog
 
@@ -488,20 +685,86 @@ void DriverNodelet::irCb(const ImageBuffer& ir_image, void* cookie)
       ir_frame_counter_++;
       checkFrameCounters();
       publish = publish_ir_;
+      publish_ir_ = false;
 
       if (publish)
           ir_frame_counter_ = 0; // Reset counter if we publish this message to avoid under-throttling
   }
 
   if (publish)
-      publishIrImage(ir_image, time);
-  publish_ir_ = false;
+      frame_executor_.post(ir_stream_, StampedFrame(ir_image, time));
 }
 
-void DriverNodelet::publishRgbImage(const ImageBuffer& image, ros::Time time) const
+void DriverNodelet::rgbDepthCb(const FrameHandle& image, const FrameHandle& depth_image, void* cookie)
+{
+  rgb_latency_.callback.recordSince(image->arrival_us);
+  depth_latency_.callback.recordSince(depth_image->arrival_us);
+  // One stamp for both, so subscribers can match them exactly
+  ros::Time now = ros::Time::now ();
+  ros::Time rgb_time = now + ros::Duration(config_.image_time_offset);
+  ros::Time depth_time = now + ros::Duration(config_.depth_time_offset);
+  rgb_time_stamp_ = rgb_time; // for watchdog
+  depth_time_stamp_ = depth_time;
+
+  bool publish = false;
+  {
+      boost::unique_lock<boost::mutex> counter_lock(counter_mutex_);
+      rgb_frame_counter_++;
+      depth_frame_counter_++;
+      checkFrameCounters();
+      publish = publish_rgb_ || publish_depth_;
+      publish_rgb_ = publish_depth_ = false;
+
+      if (publish)
+          rgb_frame_counter_ = depth_frame_counter_ = 0;
+  }
+
+  // Through the depth stream only, so a pair is published or dropped as a whole
+  if (publish)
+      frame_executor_.post(depth_stream_, StampedFrame(depth_image, depth_time, image, rgb_time));
+}
+
+void DriverNodelet::publishRgbFrame(const StampedFrame& rgb)
+{
+  publishRgbImage(rgb.frame, rgb.time);
+}
+
+void DriverNodelet::publishDepthFrame(const StampedFrame& depth)
+{
+  if (depth.image.valid())
+    publishRgbImage(depth.image, depth.image_time);
+  publishDepthImage(depth.frame, depth.time, depth.image);
+}
+
+void DriverNodelet::publishIrFrame(const StampedFrame& ir)
+{
+  publishIrImage(ir.frame, ir.time);
+}
+
+sensor_msgs::ImagePtr DriverNodelet::getImageMessage(const FrameHandle& frame) const
+{
+  // In zero copy mode the frame already lives in a message we can publish
+  sensor_msgs::ImagePtr msg =
+    boost::static_pointer_cast<sensor_msgs::Image>(frame.detachStorage());
+  if (!msg)
+  {
+    // assign() copies without zero-filling the vector first
+    const unsigned char* data = frame->image_buffer.get();
+    msg = boost::make_shared<sensor_msgs::Image>();
+    msg->data.assign(data, data + frame->metadata.bytes);
+  }
+  return msg;
+}
+
+void DriverNodelet::publishRgbImage(const FrameHandle& frame, ros::Time time) const
 {
   //NODELET_INFO_THROTTLE(1.0, "rgb image callback called");
-  sensor_msgs::ImagePtr rgb_msg = boost::make_shared<sensor_msgs::Image >();
+  // The stream may only run for the colored points
+  if (pub_rgb_.getNumSubscribers() == 0)
+    return;
+
+  const ImageBuffer& image = *frame;
+  sensor_msgs::ImagePtr rgb_msg = getImageMessage(frame);
   rgb_msg->header.stamp = time;
   rgb_msg->header.frame_id = rgb_frame_id_;
   rgb_msg->height = image.metadata.height;
@@ -524,28 +787,27 @@ void DriverNodelet::publishRgbImage(const ImageBuffer& image, ros::Time time) co
       // Unknown encoding -- don't publish
       return;
   }
-  rgb_msg->data.resize(rgb_msg->height * rgb_msg->step);
-  fillImage(image, reinterpret_cast<void*>(&rgb_msg->data[0]));
-  
-  pub_rgb_.publish(rgb_msg, getRgbCameraInfo(image, time));
+  sensor_msgs::CameraInfoPtr rgb_info = getRgbCameraInfo(image, time);
+  rgb_latency_.processed.recordSince(image.arrival_us);
+  pub_rgb_.publish(rgb_msg, rgb_info);
+  recordFirstPublish();
+  rgb_latency_.published.recordSince(image.arrival_us);
   if (enable_rgb_diagnostics_)
       pub_rgb_freq_->tick();
 }
 
-void DriverNodelet::publishDepthImage(const ImageBuffer& depth, ros::Time time) const
+void DriverNodelet::publishDepthImage(const FrameHandle& frame, ros::Time time, const FrameHandle& image)
 {
   //NODELET_INFO_THROTTLE(1.0, "depth image callback called");
+  const ImageBuffer& depth = *frame;
   bool registered = depth.is_registered;
 
-  sensor_msgs::ImagePtr depth_msg = boost::make_shared<sensor_msgs::Image>();
+  sensor_msgs::ImagePtr depth_msg = getImageMessage(frame);
   depth_msg->header.stamp    = time;
   depth_msg->encoding        = sensor_msgs::image_encodings::TYPE_16UC1;
   depth_msg->height          = depth.metadata.height;
   depth_msg->width           = depth.metadata.width;
   depth_msg->step            = depth_msg->width * sizeof(short);
-  depth_msg->data.resize(depth_msg->height * depth_msg->step);
-
-  fillImage(depth, reinterpret_cast<void*>(&depth_msg->data[0]));
 
   // EXPERIMENTAL - nick
 //  time_t t = ::time(0);
@@ -563,9 +825,9 @@ void DriverNodelet::publishDepthImage(const ImageBuffer& depth, ros::Time time)
 //      data[i] = i % 1024;
 //    }
 //  }
-  FaceFilterHistogramTransform ffht;
+  // Only the depth stream's worker gets here, so the filter is never used concurrently
   uint16_t* data = reinterpret_cast<uint16_t*>(&depth_msg->data[0]);
-  ffht.Transform(depth_msg->width, depth_msg->height, data);
+  face_filter_->Transform(depth_msg->width, depth_msg->height, data);
 
   // END OF EXPERIMENTAL - nick
 
@@ -577,21 +839,34 @@ void DriverNodelet::publishDepthImage(const ImageBuffer& depth, ros::Time time)
         data[i] += z_offset_mm_;
   }
 
+  sensor_msgs::CameraInfoPtr depth_info;
   if (registered)
   {
     // Publish RGB camera info and raw depth image to depth_registered/ ns
     depth_msg->header.frame_id = rgb_frame_id_;
-    pub_depth_registered_.publish(depth_msg, getRgbCameraInfo(depth, time));
+    depth_info = getRgbCameraInfo(depth, time);
+    depth_latency_.processed.recordSince(depth.arrival_us);
+    pub_depth_registered_.publish(depth_msg, depth_info);
   }
   else
   {
     // Publish depth camera info and raw depth image to depth/ ns
     depth_msg->header.frame_id = depth_frame_id_;
-    pub_depth_.publish(depth_msg, getDepthCameraInfo(depth, time));
+    depth_info = getDepthCameraInfo(depth, time);
+    depth_latency_.processed.recordSince(depth.arrival_us);
+    pub_depth_.publish(depth_msg, depth_info);
   }
+  recordFirstPublish();
+  depth_latency_.published.recordSince(depth.arrival_us);
   if (enable_depth_diagnostics_)
       pub_depth_freq_->tick();
 
+  // Registered depth is pixel-aligned with the RGB frame paired with it, if any
+  if (!registered && pub_points_.getNumSubscribers() > 0)
+    publishPoints(*depth_msg, *depth_info, NULL);
+  else if (registered && image.valid() && pub_points_registered_.getNumSubscribers() > 0)
+    publishPoints(*depth_msg, *depth_info, &*image);
+
   // Projector "info" probably only useful for working with disparity images
   if (pub_projector_info_.getNumSubscribers() > 0)
   {
@@ -599,20 +874,97 @@ void DriverNodelet::publishDepthImage(const ImageBuffer& depth, ros::Time time)
   }
 }
 
-void DriverNodelet::publishIrImage(const ImageBuffer& ir, ros::Time time) const
+void DriverNodelet::recordFirstPublish() const
+{
+  // Usually the flush was measured already, then this only costs two loads
+  const uint64_t flush_start = device_->getLastFlushStartUs();
+  uint64_t measured = measured_flush_start_us_;
+  if (flush_start == measured)
+    return;
+  // Only the first of the publishing threads records it
+  if (measured_flush_start_us_.compare_exchange_strong(measured, flush_start))
+  {
+    const uint64_t now = frameClockUs();
+    first_publish_us_ = now > flush_start ? now - flush_start : 0;
+  }
+}
+
+void DriverNodelet::publishPoints(const sensor_msgs::Image& depth, const sensor_msgs::CameraInfo& info,
+                                  const ImageBuffer* image)
 {
-  sensor_msgs::ImagePtr ir_msg = boost::make_shared<sensor_msgs::Image>();
+  if (image != NULL)
+  {
+    if (image->metadata.width != static_cast<int>(depth.width) ||
+        image->metadata.height != static_cast<int>(depth.height))
+    {
+      NODELET_WARN_THROTTLE(10.0, "Cannot color points of a %ux%u depth image with a %dx%d RGB image, "
+                            "use the same resolution for both", depth.width, depth.height,
+                            image->metadata.width, image->metadata.height);
+      return;
+    }
+    if (image->metadata.video_format != FREENECT_VIDEO_BAYER &&
+        image->metadata.video_format != FREENECT_VIDEO_RGB)
+    {
+      NODELET_WARN_THROTTLE(10.0, "Cannot color points with YUV images");
+      return;
+    }
+  }
+
+  // The rays are only rebuilt when the mode or the calibration changed
+  point_rays_.update(depth.width, depth.height, info.K[0], info.K[4], info.K[2], info.K[5]);
+
+  sensor_msgs::PointCloud2Ptr cloud = boost::make_shared<sensor_msgs::PointCloud2>();
+  cloud->header       = depth.header;
+  cloud->height       = depth.height;
+  cloud->width        = depth.width;
+  cloud->is_bigendian = false;
+  cloud->is_dense     = false;
+  // The color goes into the padding, where PCL's XYZRGB points keep it too
+  const char* names[] = { "x", "y", "z", "rgb" };
+  cloud->fields.resize(image != NULL ? 4 : 3);
+  for (unsigned i = 0; i < cloud->fields.size(); ++i)
+  {
+    cloud->fields[i].name     = names[i];
+    cloud->fields[i].offset   = i * sizeof(float);
+    cloud->fields[i].datatype = sensor_msgs::PointField::FLOAT32;
+    cloud->fields[i].count    = 1;
+  }
+  cloud->point_step = DepthRayTable::POINT_STEP;
+  cloud->row_step   = cloud->point_step * cloud->width;
+  cloud->data.resize(cloud->row_step * cloud->height);
+  const uint16_t* depth_data = reinterpret_cast<const uint16_t*>(&depth.data[0]);
+  if (image == NULL)
+  {
+    point_rays_.project(depth_data, &cloud->data[0]);
+    pub_points_.publish(cloud);
+  }
+  else
+  {
+    const uint8_t* image_data = image->image_buffer.get();
+    if (image->metadata.video_format == FREENECT_VIDEO_BAYER)
+      point_rays_.projectBayer(depth_data, image_data, &cloud->data[0]);
+    else
+      point_rays_.projectRgb(depth_data, image_data, &cloud->data[0]);
+    pub_points_registered_.publish(cloud);
+  }
+}
+
+void DriverNodelet::publishIrImage(const FrameHandle& frame, ros::Time time) const
+{
+  const ImageBuffer& ir = *frame;
+  sensor_msgs::ImagePtr ir_msg = getImageMessage(frame);
   ir_msg->header.stamp    = time;
   ir_msg->header.frame_id = depth_frame_id_;
   ir_msg->encoding        = sensor_msgs::image_encodings::MONO16;
   ir_msg->height          = ir.metadata.height;
   ir_msg->width           = ir.metadata.width;
   ir_msg->step            = ir_msg->width * sizeof(uint16_t);
-  ir_msg->data.resize(ir_msg->height * ir_msg->step);
-
-  fillImage(ir, reinterpret_cast<void*>(&ir_msg->data[0]));
 
-  pub_ir_.publish(ir_msg, getIrCameraInfo(ir, time));
+  sensor_msgs::CameraInfoPtr ir_info = getIrCameraInfo(ir, time);
+  ir_latency_.processed.recordSince(ir.arrival_us);
+  pub_ir_.publish(ir_msg, ir_info);
+  recordFirstPublish();
+  ir_latency_.published.recordSince(ir.arrival_us);
 
   if (enable_ir_diagnostics_) 
       pub_ir_freq_->tick();
@@ -797,10 +1149,11 @@ void DriverNodelet::configCb(Config &config, uint32_t level)
 
 void DriverNodelet::startSynchronization()
 {
-  if (device_->isSynchronizationSupported() &&
-      !device_->isSynchronized() &&
-      device_->isImageStreamRunning() &&
-      device_->isDepthStreamRunning() )
+  // The device only pairs frames while both streams run, so this can come
+  // before they actually started
+  if ((synchronize_rgb_depth_ || needColoredPoints()) &&
+      device_->isSynchronizationSupported() &&
+      !device_->isSynchronized())
   {
     device_->setSynchronization(true);
   }
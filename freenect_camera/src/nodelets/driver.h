@@ -52,6 +52,13 @@
 
 // freenect wrapper
 #include <freenect_camera/freenect_driver.hpp>
+#include <freenect_camera/frame_executor.hpp>
+#include <freenect_camera/frame_latency.hpp>
+#include <freenect_camera/work_stealing_pool.hpp>
+#include "face_filter.h"
+#include "flight_recorder.h"
+#include "point_cloud.h"
+#include "replay_backend.h"
 
 // diagnostics
 #include <diagnostic_updater/diagnostic_updater.h>
@@ -84,14 +91,18 @@ namespace freenect_camera
       OutputMode mapConfigMode2OutputMode (int mode) const;
 
       // Callback methods
-      void rgbCb(const ImageBuffer& image, void* cookie);
-      void depthCb(const ImageBuffer& depth_image, void* cookie);
-      void irCb(const ImageBuffer&_image, void* cookie);
+      void rgbCb(const FrameHandle& image, void* cookie);
+      void depthCb(const FrameHandle& depth_image, void* cookie);
+      void irCb(const FrameHandle& ir_image, void* cookie);
+      void rgbDepthCb(const FrameHandle& image, const FrameHandle& depth_image, void* cookie);
       void configCb(Config &config, uint32_t level);
 
       void rgbConnectCb();
       void depthConnectCb();
       void irConnectCb();
+      void pointsConnectCb();
+      /** \brief whether someone subscribed to the XYZRGB points, which are made of RGB-D pairs */
+      bool needColoredPoints() const;
 
       // Methods to get calibration parameters for the various cameras
       sensor_msgs::CameraInfoPtr getDefaultCameraInfo(int width, int height, double f) const;
@@ -105,6 +116,7 @@ namespace freenect_camera
       image_transport::CameraPublisher pub_depth_, pub_depth_registered_;
       image_transport::CameraPublisher pub_ir_;
       ros::Publisher pub_projector_info_;
+      ros::Publisher pub_points_, pub_points_registered_;
 
       // Maintain frequency diagnostics on all sensors
       boost::shared_ptr<diagnostic_updater::Updater> diagnostic_updater_;
@@ -117,12 +129,83 @@ namespace freenect_camera
       bool enable_ir_diagnostics_;
       boost::thread diagnostics_thread_;
       void updateDiagnostics();
+      void frameBufferDiagnostics(diagnostic_updater::DiagnosticStatusWrapper& stat);
+      void frameLatencyDiagnostics(diagnostic_updater::DiagnosticStatusWrapper& stat);
       bool close_diagnostics_;
 
+      /** \brief face filter tracing, declared first so it outlives the face filter writing to it */
+      boost::shared_ptr<FlightRecorder> face_filter_trace_;
+
+      /** \brief depth post-processing, kept across frames so its scratch memory is reused */
+      boost::shared_ptr<DepthDataTransform> face_filter_;
+
+      /** \brief Lets the face filter split its stages over a WorkStealingPool */
+      class PoolParallelFor : public ParallelFor
+      {
+        public:
+          explicit PoolParallelFor(const WorkStealingPoolPtr& pool) : pool_(pool) {}
+
+          virtual void Run(uint32_t count, Body body, void* context)
+          {
+            Task task = { body, context };
+            pool_->parallelFor(count, 1, task);
+          }
+
+        private:
+          struct Task
+          {
+            Body body;
+            void* context;
+            void operator()(unsigned begin, unsigned end) const { body(context, begin, end); }
+          };
+
+          WorkStealingPoolPtr pool_;
+      };
+
+      /** \brief threads shared by the parallel parts of per-frame processing */
+      WorkStealingPoolPtr worker_pool_;
+      boost::shared_ptr<PoolParallelFor> face_filter_parallel_for_;
+
       // publish methods
-      void publishRgbImage(const ImageBuffer& image, ros::Time time) const;
-      void publishDepthImage(const ImageBuffer& depth, ros::Time time) const;
-      void publishIrImage(const ImageBuffer& ir, ros::Time time) const;
+      void publishRgbImage(const FrameHandle& image, ros::Time time) const;
+      void publishDepthImage(const FrameHandle& depth, ros::Time time, const FrameHandle& image);
+      void publishIrImage(const FrameHandle& ir, ros::Time time) const;
+      sensor_msgs::ImagePtr getImageMessage(const FrameHandle& frame) const;
+      void publishPoints(const sensor_msgs::Image& depth, const sensor_msgs::CameraInfo& info,
+                         const ImageBuffer* image);
+
+      /** \brief rays of the depth pixels for the points topics, only used by the depth stream's worker */
+      DepthRayTable point_rays_;
+
+      /** \brief A frame waiting to be published, with its arrival time */
+      struct StampedFrame
+      {
+        StampedFrame() {}
+        StampedFrame(const FrameHandle& frame, ros::Time time) : frame(frame), time(time) {}
+        StampedFrame(const FrameHandle& frame, ros::Time time, const FrameHandle& image, ros::Time image_time)
+          : frame(frame), time(time), image(image), image_time(image_time) {}
+        FrameHandle frame;
+        ros::Time time;
+        /** \brief The RGB frame paired with a depth frame, if synchronized */
+        FrameHandle image;
+        ros::Time image_time;
+      };
+
+      void publishRgbFrame(const StampedFrame& rgb);
+      void publishDepthFrame(const StampedFrame& depth);
+      void publishIrFrame(const StampedFrame& ir);
+
+      /** \brief publishes frames off the libfreenect thread */
+      FrameExecutor<StampedFrame> frame_executor_;
+      unsigned rgb_stream_, depth_stream_, ir_stream_;
+
+      /** \brief latency of each stream's frames from their arrival, recorded by the const publish methods too */
+      mutable FrameLatencies rgb_latency_, depth_latency_, ir_latency_;
+
+      /** \brief measures the time from the start of the device's last flush to the first frame published after it */
+      void recordFirstPublish() const;
+      /** \brief flush start the first published frame was last measured from, and the time it took */
+      mutable boost::atomic<uint64_t> measured_flush_start_us_, first_publish_us_;
 
       /** \brief the actual openni device */
       boost::shared_ptr<FreenectDevice> device_;
@@ -164,6 +247,15 @@ namespace freenect_camera
       /** \brief enable libfreenect debugging */
       bool libfreenect_debug_;
 
+      /** \brief let libfreenect write frames directly into the published messages */
+      bool zero_copy_;
+
+      /** \brief publish RGB and depth frames the device paired with one stamp */
+      bool synchronize_rgb_depth_;
+
+      /** \brief publish depth/points and, colored, depth_registered/points */
+      bool publish_points_;
+
       std::map<OutputMode, int> mode2config_map_;
       std::map<int, OutputMode> config2mode_map_;
   };
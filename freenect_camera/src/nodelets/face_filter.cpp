@@ -1,17 +1,111 @@
 #include "face_filter.h"
 #include "face_filter.hpp"
+#include "face_filter_fixed.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _MSC_VER
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FACE_FILTER_SSE2
+#endif
 
 namespace freenect_camera
 {
+  // One block of scratch memory, carved up once. Nothing in it is reallocated per frame.
+  class Arena
+  {
+  public:
+    Arena() : _size(0), _base(NULL) {}
+
+    // Reserves room for count values of T and returns the offset to pass to Get().
+    template<typename T> size_t Reserve(size_t count)
+    {
+      assert(_base == NULL && "Arena is already allocated.");
+      const size_t offset = (_size + _alignment - 1) / _alignment * _alignment;
+      _size = offset + count * sizeof(T);
+      return offset;
+    }
+
+    void Allocate()
+    {
+      _block.resize(_size + _alignment);
+      const size_t address = reinterpret_cast<size_t>(&_block[0]);
+      _base = &_block[0] + ((_alignment - address % _alignment) % _alignment);
+    }
+
+    template<typename T> T* Get(size_t offset)
+    {
+      assert(_base != NULL && "Arena is not allocated yet.");
+      return reinterpret_cast<T*>(_base + offset);
+    }
+
+  private:
+    static const size_t _alignment = 64;
+    size_t _size;
+    std::vector<char> _block;
+    char* _base;
+  };
+
+  // Half-open rectangle [x0, x1) x [y0, y1) in mask coordinates.
+  struct MaskRect
+  {
+    uint16_t x0, y0, x1, y1;
+  };
+
+  // Position of a mask tap relative to the mask center.
+  struct MaskTap
+  {
+    int16_t dx, dy;
+  };
+
   struct Mask
   {
     static const uint16_t _maxScore = 20000;
     uint16_t _lengthOneSide;
     std::vector<int16_t> _matrix;
-    std::vector<int16_t> _selectionIndexes;
+
+    // Only the non-negative taps take part in the selection and only the negative ones are
+    // clipped by the grid border, so each set is also kept as a list of its taps.
+    // _selectionIndexes has the selection taps as offsets into a grid _selectionStride wide,
+    // for segments far enough from the border that no tap has to be clipped.
+    std::vector<MaskTap> _selectionTaps;
+    std::vector<MaskTap> _negativeTaps;
+    std::vector<int32_t> _selectionIndexes;
+    uint32_t _selectionStride;
+
+    // The mask only has one positive and one negative value, so it is also kept as the
+    // rectangles covering each of them. Scoring then needs a few integral image lookups
+    // per rectangle instead of one per tap.
+    int16_t _positiveScore;
+    int16_t _negativeScore;
+    std::vector<MaskRect> _positiveRects;
+    std::vector<MaskRect> _negativeRects;
+
+    // Bit mx of row my is set where the mask has a positive (negative) tap, for masks no
+    // wider than 64 taps.
+    std::vector<uint64_t> _positiveRows;
+    std::vector<uint64_t> _negativeRows;
 
     Mask(uint16_t diameter, uint16_t innerHole);
-    void ApplySelection(std::vector<char>& filter, uint32_t segmentsOneSide, uint32_t layersCount);
+    void ApplySelection(char* filter, uint32_t segmentsOneSide, uint32_t layersCount);
+
+  private:
+    void DecomposeIntoRects(int sign, std::vector<MaskRect>& rects) const;
   };
 
 #ifdef _MSC_VER
@@ -20,31 +114,126 @@ namespace freenect_camera
 
   struct FaceFilterHistogramTransformData
   {
-    FaceFilterHistogramTransformData(uint32_t layersCount, uint32_t segmentsCount = 20, uint32_t depthMax = 4000, bool tracingEnabled = false, const std::string& fileNameBaseTrace = std::string());
+    FaceFilterHistogramTransformData(uint32_t layersCount, uint32_t segmentsCount = 20, uint32_t depthMax = 4000, TraceSink* traceSink = NULL);
+    void BeginFrame(uint32_t width, uint32_t height);
+    void SetParallelFor(ParallelFor* parallelFor) { _parallelFor = parallelFor; }
+    void SetIncremental(bool enabled, uint32_t fullRecomputeInterval);
     void PlacePoints(uint32_t width, uint32_t height, uint16_t* data);
     void ApplyMask();
+    void ApplySelection();
     void FilterDepthData(uint32_t width, uint32_t height, uint16_t* data);
 
   private:
     const uint32_t _layersCount;
     const uint32_t _depthMax;
     const uint32_t _segmentsCount;
-    bool _tracingEnabled;
-    const std::string& _fileNameBaseTrace;
+    const uint32_t _segmentsTotal;
+    // Counters per segment in _binnedSegments; the extra one collects pixels without depth.
+    const uint32_t _binStride;
+    // Not owned, NULL when not tracing
+    TraceSink* _traceSink;
+    uint64_t _frameIndex;
+
+    // All per-frame state lives in the arena: the histogram in both layouts, the segment
+    // filter, the per-layer scores and the per-segment depth limits.
+    // The depth to layer table is in there as well, it only depends on constructor arguments.
+    Arena _arena;
+    uint8_t* _depthToLayer;
+    // Segment-major histogram, _binStride counters per segment. Neighbouring pixels
+    // mostly fall into the same segment, so binning keeps hitting the same cache line.
+    uint16_t* _binnedSegments;
+    // Layer-major copy of _binnedSegments, one _segmentsCount x _segmentsCount grid per
+    // layer, which is what the mask pass walks.
+    uint16_t* _layeredSegments;
+    char* _segmentFilter;
+    uint16_t* _maxAllowedDepth;
+    // Scores and occupancy integral image of every layer, so layers can be scored in
+    // parallel. The integral images are padded by the mask reach on every side so no
+    // lookup has to be clipped: _integralSide + 1 values per row.
+    uint16_t* _layerScores;
+    uint32_t _integralSide;
+    uint32_t* _layerIntegrals;
+    // In-grid taps of the negative part of the mask, per segment. Only depends on geometry.
+    uint16_t* _negativeInGrid;
 
-    std::vector<std::vector<uint16_t> > _layeredSegments;
-    std::vector<char> _segmentFilter;
+    // Bit-packed occupancy, used instead of the integral image when the layers fit into a
+    // 64-bit word and a padded segment row fits into another one (and nothing is traced):
+    // - bit j of _occupancy[i] is set when segment i has points in layer j,
+    // - _rowCandidates[i] is the OR of _occupancy over the mask's columns around i,
+    // - _candidates[i] holds the layers occupied anywhere under the mask centered at i,
+    // - bit (x + padding) of _rowBitmaps[j * _bitmapRows + y + padding] is set when
+    //   segment (x, y) has points in layer j. Padding rows and columns stay empty.
+    bool _useBitmaps;
+    uint32_t _bitmapRows;
+    uint64_t* _occupancy;
+    uint64_t* _rowCandidates;
+    uint64_t* _candidates;
+    uint64_t* _rowBitmaps;
+    // Highest layer scoring above the threshold per segment, before ApplySelection().
+    char* _decisions;
 
-    // TODO: pre-generate the mask
+    // Incremental mode, bitmap engine only: the histogram, the previous raw frame, the
+    // occupancy and the decisions are kept across frames. Only pixels that differ from the
+    // previous frame are rebinned, and only segments whose mask covers a segment with
+    // changed occupancy are scored again. Counts are updated exactly, so the result is the
+    // same as a full pass; a full pass is still forced every _fullRecomputeInterval frames.
+    bool _incremental;
+    uint32_t _fullRecomputeInterval;
+    uint32_t _framesSinceFull;
+    bool _historyValid;
+    // The current frame is processed incrementally
+    bool _updateOnly;
+    std::vector<uint16_t> _previousFrame;
+    uint64_t* _previousOccupancy;
+    char* _affected;
+
+    // Resolution dependent tables, rebuilt by PrepareTables() when the frame size changes.
+    // Pixels [_columnRunStarts[s], _columnRunStarts[s + 1]) of a row belong to segment
+    // column s, and rows [_rowRunStarts[s], _rowRunStarts[s + 1]) to segment row s.
+    uint32_t _tableWidth;
+    uint32_t _tableHeight;
+    std::vector<uint32_t> _columnRunStarts;
+    std::vector<uint32_t> _rowRunStarts;
+    // Maximum allowed depth of every pixel, one row per segment row.
+    std::vector<uint16_t> _rowMaxAllowedDepth;
+
+    // Work is split into ranges of segment rows (or layers), which touch disjoint parts of
+    // the state, so the result does not depend on how the ranges are scheduled.
+    ParallelFor* _parallelFor;
+    uint32_t _frameWidth;
+    uint16_t* _frame;
+    typedef void (FaceFilterHistogramTransformData::*RangeMethod)(uint32_t begin, uint32_t end);
+    struct RangeCall
+    {
+      FaceFilterHistogramTransformData* self;
+      RangeMethod method;
+    };
+    static void CallRange(void* context, uint32_t begin, uint32_t end);
+    void ForEach(uint32_t count, RangeMethod method);
+    void BuildRunStarts(uint32_t pixels, std::vector<uint32_t>& starts);
+    void Reset();
+    void PrepareTables(uint32_t width, uint32_t height);
+    void PlaceSegmentRows(uint32_t begin, uint32_t end);
+    void UpdateSegmentRows(uint32_t begin, uint32_t end);
+    void MarkAffectedSegments();
+    void ScoreLayers(uint32_t begin, uint32_t end);
+    void ScoreSegmentRows(uint32_t begin, uint32_t end);
+    void ClampSegmentRows(uint32_t begin, uint32_t end);
+
+    // Generated at run time; FixedFaceFilterHistogramTransform has it as compile-time constants
     Mask _mask;
     uint32_t LayerToDepth(uint32_t layer);
     uint32_t DepthToLayer(uint32_t depth);
 
-    void PlacePoint(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint16_t value);
-    void ApplyMask(const std::vector<uint16_t>& layer, const Mask& mask, std::vector<uint16_t>& scores);
-    inline uint32_t GetSegmentIndex(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
-    template<typename T> void Trace(const std::string& name, const std::vector<T>& data, uint32_t width, uint32_t height, uint32_t counter);
-    template<typename T> void Trace(const std::string& name, const T* data, uint32_t width, uint32_t height, uint32_t counter);
+    uint16_t* Layer(uint32_t layer) { return _layeredSegments + layer * _segmentsTotal; }
+    void TransposeHistogram();
+    void ApplyMask(const uint16_t* layer, const Mask& mask, uint32_t* integral, uint16_t* scores);
+    void BuildIntegral(const uint16_t* layer, uint32_t padding, uint32_t* integral);
+    void ApplyMaskBitmaps();
+    void BuildBitmaps();
+    inline uint32_t CountOccupied(const uint32_t* integral, uint32_t x, uint32_t y, const MaskRect& rect) const;
+    template<typename T> void Trace(const char* name, const std::vector<T>& data, uint32_t width, uint32_t height, uint32_t counter);
+    template<typename T> void Trace(const char* name, const T* data, uint32_t width, uint32_t height, uint32_t counter);
   };
 
 #ifdef _MSC_VER
@@ -53,6 +242,7 @@ namespace freenect_camera
 
 
   Mask::Mask(uint16_t maxDiameter, uint16_t minDiameter)
+    : _selectionStride(0)
   {
     _lengthOneSide = maxDiameter + 2;
     if (maxDiameter == 0)
@@ -109,32 +299,120 @@ namespace freenect_camera
         i++;
       }
     }
+
+    _positiveScore = score1;
+    _negativeScore = score2;
+
+    const int16_t centerOffset = _lengthOneSide / 2;
+    for (uint16_t y = 0; y < _lengthOneSide; ++y)
+    {
+      for (uint16_t x = 0; x < _lengthOneSide; ++x)
+      {
+        MaskTap tap = { static_cast<int16_t>(x - centerOffset), static_cast<int16_t>(y - centerOffset) };
+        if (_matrix[y * _lengthOneSide + x] >= 0)
+          _selectionTaps.push_back(tap);
+        else
+          _negativeTaps.push_back(tap);
+      }
+    }
+
+    DecomposeIntoRects(1, _positiveRects);
+    DecomposeIntoRects(-1, _negativeRects);
+
+    if (_lengthOneSide <= 64)
+    {
+      _positiveRows.assign(_lengthOneSide, 0);
+      _negativeRows.assign(_lengthOneSide, 0);
+      for (uint16_t y = 0; y < _lengthOneSide; ++y)
+      {
+        for (uint16_t x = 0; x < _lengthOneSide; ++x)
+        {
+          const int16_t value = _matrix[y * _lengthOneSide + x];
+          if (value > 0)
+            _positiveRows[y] |= 1ULL << x;
+          else if (value < 0)
+            _negativeRows[y] |= 1ULL << x;
+        }
+      }
+    }
   }
 
-  void Mask::ApplySelection(std::vector<char>& filter, uint32_t segmentsOneSide, uint32_t layersCount)
+  void Mask::DecomposeIntoRects(int sign, std::vector<MaskRect>& rects) const
   {
+    // Cut every row into runs of matching taps and stack a run onto the rectangle ending
+    // right above it if that one spans the same columns.
+    for (uint16_t y = 0; y < _lengthOneSide; ++y)
+    {
+      uint16_t x = 0;
+      while (x < _lengthOneSide)
+      {
+        const int16_t value = _matrix[y * _lengthOneSide + x];
+        if (value == 0 || (value > 0) != (sign > 0))
+        {
+          x++;
+          continue;
+        }
+
+        uint16_t end = x + 1;
+        while (end < _lengthOneSide && _matrix[y * _lengthOneSide + end] == value)
+          end++;
+
+        bool extended = false;
+        for (size_t r = 0; r < rects.size() && !extended; ++r)
+        {
+          if (rects[r].y1 == y && rects[r].x0 == x && rects[r].x1 == end)
+          {
+            rects[r].y1++;
+            extended = true;
+          }
+        }
+        if (!extended)
+        {
+          MaskRect rect = { x, y, end, static_cast<uint16_t>(y + 1) };
+          rects.push_back(rect);
+        }
+        x = end;
+      }
+    }
+  }
+
+  void Mask::ApplySelection(char* filter, uint32_t segmentsOneSide, uint32_t layersCount)
+  {
+    if (_selectionStride != segmentsOneSide)
+    {
+      _selectionIndexes.resize(_selectionTaps.size());
+      for (size_t t = 0; t < _selectionTaps.size(); ++t)
+        _selectionIndexes[t] = _selectionTaps[t].dy * static_cast<int32_t>(segmentsOneSide) + _selectionTaps[t].dx;
+      _selectionStride = segmentsOneSide;
+    }
+
+    // Empty segments under the ring or the hole of a selected segment are marked with its
+    // layer + layersCount. Marked segments are not selected again, so the scan order matters,
+    // but the order of the taps of one segment does not.
+    const int32_t segmentsCount = static_cast<int32_t>(segmentsOneSide);
+    const int32_t centerOffset = _lengthOneSide / 2;
+    const int32_t interiorEnd = segmentsCount - (_lengthOneSide - 1 - centerOffset);
+    const size_t tapsCount = _selectionTaps.size();
     uint32_t index = 0;
-    for (uint32_t y = 0; y < segmentsOneSide; ++y) {
-      for (uint32_t x = 0; x < segmentsOneSide; ++x) {
-        assert((index == y * segmentsOneSide + x) && "Index must be always increasing by 1.");
+    for (int32_t y = 0; y < segmentsCount; ++y) {
+      for (int32_t x = 0; x < segmentsCount; ++x) {
+        assert((index == static_cast<uint32_t>(y * segmentsCount + x)) && "Index must be always increasing by 1.");
         uint32_t filterValue = filter[index];
         if (filterValue > 0 && filterValue < layersCount){
-          uint16_t centerOffset = _lengthOneSide / 2;
-          int32_t maskIndex = 0;
-          for (uint16_t my = 0; my < _lengthOneSide; ++my) {
-            for (uint16_t mx = 0; mx < _lengthOneSide; ++mx) {
-              int32_t tx = x + mx - centerOffset;
-              int32_t ty = y + my - centerOffset;
-              int32_t tIndex = ty * segmentsOneSide + tx;
-              assert((maskIndex == my * _lengthOneSide + mx) && "Index must be always increasing by 1.");
-              const int32_t segmentsCount = static_cast<int32_t>(segmentsOneSide);
-
-              if (tx >= 0 && tx < segmentsCount && ty >= 0 && ty < segmentsCount){
-                if (_matrix[maskIndex] >= 0 && filter[tIndex] == 0) {
-                  filter[tIndex] = filter[index] + static_cast<char>(layersCount);
-                }
-              }
-              maskIndex++;
+          const char marked = filter[index] + static_cast<char>(layersCount);
+          if (x >= centerOffset && x < interiorEnd && y >= centerOffset && y < interiorEnd) {
+            char* center = filter + index;
+            for (size_t t = 0; t < tapsCount; ++t) {
+              char& target = center[_selectionIndexes[t]];
+              target = target == 0 ? marked : target;
+            }
+          }
+          else {
+            for (size_t t = 0; t < tapsCount; ++t) {
+              const int32_t tx = x + _selectionTaps[t].dx;
+              const int32_t ty = y + _selectionTaps[t].dy;
+              if (tx >= 0 && tx < segmentsCount && ty >= 0 && ty < segmentsCount && filter[ty * segmentsCount + tx] == 0)
+                filter[ty * segmentsCount + tx] = marked;
             }
           }
         }
@@ -143,32 +421,390 @@ namespace freenect_camera
     }
   }
 
-  FaceFilterHistogramTransformData::FaceFilterHistogramTransformData(uint32_t layersCount, uint32_t segmentsCount, uint32_t depthMax, bool tracingEnabled, const std::string& fileNameBaseTrace)
-    : _mask(5, 1)
-    , _layersCount(layersCount)
+  FaceFilterHistogramTransformData::FaceFilterHistogramTransformData(uint32_t layersCount, uint32_t segmentsCount, uint32_t depthMax, TraceSink* traceSink)
+    : _layersCount(layersCount)
     , _depthMax(depthMax)
     , _segmentsCount(segmentsCount)
-    , _tracingEnabled(tracingEnabled)
-    , _fileNameBaseTrace(fileNameBaseTrace)
+    , _segmentsTotal(segmentsCount * segmentsCount)
+    , _binStride(layersCount + 1)
+    , _traceSink(traceSink)
+    , _frameIndex(0)
+    , _incremental(false)
+    , _fullRecomputeInterval(0)
+    , _framesSinceFull(0)
+    , _historyValid(false)
+    , _updateOnly(false)
+    , _tableWidth(0)
+    , _tableHeight(0)
+    , _parallelFor(NULL)
+    , _frameWidth(0)
+    , _frame(NULL)
+    , _mask(5, 1)
+  {
+    assert(_layersCount < 256 && "Layers must fit into the depth to layer table.");
+    const size_t depthToLayer = _arena.Reserve<uint8_t>(65536);
+    const size_t binnedSegments = _arena.Reserve<uint16_t>(_segmentsTotal * _binStride);
+    const size_t layeredSegments = _arena.Reserve<uint16_t>(_layersCount * _segmentsTotal);
+    const size_t segmentFilter = _arena.Reserve<char>(_segmentsTotal);
+    const size_t maxAllowedDepth = _arena.Reserve<uint16_t>(_segmentsTotal);
+    const size_t negativeInGrid = _arena.Reserve<uint16_t>(_segmentsTotal);
+
+    _integralSide = _segmentsCount + _mask._lengthOneSide - 1;
+    _useBitmaps = _traceSink == NULL && _layersCount <= 64 && _integralSide <= 64;
+    _bitmapRows = _integralSide;
+    const uint32_t integralSize = (_integralSide + 1) * (_integralSide + 1);
+    size_t layerScores = 0, layerIntegrals = 0;
+    size_t occupancy = 0, rowCandidates = 0, candidates = 0, rowBitmaps = 0;
+    size_t decisions = 0, previousOccupancy = 0, affected = 0;
+    if (!_useBitmaps)
+    {
+      layerScores = _arena.Reserve<uint16_t>(_layersCount * _segmentsTotal);
+      layerIntegrals = _arena.Reserve<uint32_t>(_layersCount * integralSize);
+    }
+    else
+    {
+      occupancy = _arena.Reserve<uint64_t>(_segmentsTotal);
+      rowCandidates = _arena.Reserve<uint64_t>(_segmentsTotal);
+      candidates = _arena.Reserve<uint64_t>(_segmentsTotal);
+      rowBitmaps = _arena.Reserve<uint64_t>(_layersCount * _bitmapRows);
+      decisions = _arena.Reserve<char>(_segmentsTotal);
+      previousOccupancy = _arena.Reserve<uint64_t>(_segmentsTotal);
+      affected = _arena.Reserve<char>(_segmentsTotal);
+    }
+    _arena.Allocate();
+
+    _depthToLayer = _arena.Get<uint8_t>(depthToLayer);
+    _depthToLayer[0] = static_cast<uint8_t>(_layersCount);
+    for (uint32_t depth = 1; depth < 65536; ++depth)
+    {
+      _depthToLayer[depth] = static_cast<uint8_t>(DepthToLayer(depth));
+    }
+
+    _binnedSegments = _arena.Get<uint16_t>(binnedSegments);
+    _layeredSegments = _arena.Get<uint16_t>(layeredSegments);
+    _segmentFilter = _arena.Get<char>(segmentFilter);
+    _maxAllowedDepth = _arena.Get<uint16_t>(maxAllowedDepth);
+    _negativeInGrid = _arena.Get<uint16_t>(negativeInGrid);
+    _layerScores = _useBitmaps ? NULL : _arena.Get<uint16_t>(layerScores);
+    _layerIntegrals = _useBitmaps ? NULL : _arena.Get<uint32_t>(layerIntegrals);
+    _occupancy = _useBitmaps ? _arena.Get<uint64_t>(occupancy) : NULL;
+    _rowCandidates = _useBitmaps ? _arena.Get<uint64_t>(rowCandidates) : NULL;
+    _candidates = _useBitmaps ? _arena.Get<uint64_t>(candidates) : NULL;
+    _rowBitmaps = _useBitmaps ? _arena.Get<uint64_t>(rowBitmaps) : NULL;
+    _decisions = _useBitmaps ? _arena.Get<char>(decisions) : NULL;
+    _previousOccupancy = _useBitmaps ? _arena.Get<uint64_t>(previousOccupancy) : NULL;
+    _affected = _useBitmaps ? _arena.Get<char>(affected) : NULL;
+
+    // The integral image borders stay zero, only their interior is rewritten per layer
+    if (!_useBitmaps)
+      std::fill(_layerIntegrals, _layerIntegrals + _layersCount * integralSize, 0);
+
+    const int32_t segments = static_cast<int32_t>(_segmentsCount);
+    const std::vector<MaskTap>& negativeTaps = _mask._negativeTaps;
+    uint32_t index = 0;
+    for (int32_t y = 0; y < segments; ++y) {
+      for (int32_t x = 0; x < segments; ++x) {
+        uint16_t count = 0;
+        for (size_t t = 0; t < negativeTaps.size(); ++t) {
+          const int32_t tx = x + negativeTaps[t].dx;
+          const int32_t ty = y + negativeTaps[t].dy;
+          count += (tx >= 0 && tx < segments && ty >= 0 && ty < segments) ? 1 : 0;
+        }
+        _negativeInGrid[index++] = count;
+      }
+    }
+  }
+
+  void FaceFilterHistogramTransformData::SetIncremental(bool enabled, uint32_t fullRecomputeInterval)
   {
-    for (uint32_t i = 0; i < _layersCount; ++i)
+    _incremental = enabled && _useBitmaps;
+    _fullRecomputeInterval = fullRecomputeInterval;
+    _historyValid = false;
+    if (!_incremental)
+      std::vector<uint16_t>().swap(_previousFrame);
+  }
+
+  void FaceFilterHistogramTransformData::BeginFrame(uint32_t width, uint32_t height)
+  {
+    if (width != _tableWidth || height != _tableHeight)
     {
-      _layeredSegments.push_back(std::vector<uint16_t>(_segmentsCount * _segmentsCount));
+      PrepareTables(width, height);
+      _historyValid = false;
     }
 
-    _segmentFilter = std::vector<char>(_segmentsCount * _segmentsCount);
+    _updateOnly = _incremental && _historyValid && _framesSinceFull < _fullRecomputeInterval;
+    if (!_updateOnly)
+      Reset();
+    _frameIndex++;
+  }
+
+  void FaceFilterHistogramTransformData::Reset()
+  {
+    // _layeredSegments is overwritten as a whole by TransposeHistogram()
+    std::fill(_binnedSegments, _binnedSegments + _segmentsTotal * _binStride, 0);
+    std::fill(_segmentFilter, _segmentFilter + _segmentsTotal, 0);
+  }
+
+  void FaceFilterHistogramTransformData::PrepareTables(uint32_t width, uint32_t height)
+  {
+    BuildRunStarts(width, _columnRunStarts);
+    BuildRunStarts(height, _rowRunStarts);
+    _rowMaxAllowedDepth.resize(_segmentsCount * width);
+
+    _tableWidth = width;
+    _tableHeight = height;
+  }
+
+  void FaceFilterHistogramTransformData::BuildRunStarts(uint32_t pixels, std::vector<uint32_t>& starts)
+  {
+    // Segment of pixel p is p * _segmentsCount / pixels, so each segment is a run of pixels.
+    // Segments a small frame has no pixels for get an empty run.
+    starts.assign(_segmentsCount + 1, pixels);
+    for (uint32_t p = pixels; p-- > 0;)
+    {
+      starts[p * _segmentsCount / pixels] = p;
+    }
+    for (uint32_t s = _segmentsCount; s-- > 0;)
+    {
+      starts[s] = std::min(starts[s], starts[s + 1]);
+    }
+  }
+
+  void FaceFilterHistogramTransformData::CallRange(void* context, uint32_t begin, uint32_t end)
+  {
+    const RangeCall* call = static_cast<const RangeCall*>(context);
+    (call->self->*call->method)(begin, end);
+  }
+
+  void FaceFilterHistogramTransformData::ForEach(uint32_t count, RangeMethod method)
+  {
+    if (_parallelFor == NULL)
+    {
+      (this->*method)(0, count);
+      return;
+    }
+
+    RangeCall call = { this, method };
+    _parallelFor->Run(count, &CallRange, &call);
   }
 
   void FaceFilterHistogramTransformData::PlacePoints(uint32_t width, uint32_t height, uint16_t* data)
   {
     Trace("mask", _mask._matrix, _mask._lengthOneSide, _mask._lengthOneSide, 0);
 
-    uint32_t index = 0;
-    for (uint32_t y = 0; y < height; ++y){
-      for (uint32_t x = 0; x < width; ++x){
-        PlacePoint(x, y, width, height, data[index]);
-        assert((index == y * width + x) && "Index must be always increasing by 1.");
-        index++;
+    assert(width == _tableWidth && height == _tableHeight && "PrepareTables() must be called first.");
+    _frameWidth = width;
+    _frame = data;
+    if (_updateOnly)
+    {
+      ForEach(_segmentsCount, &FaceFilterHistogramTransformData::UpdateSegmentRows);
+      _framesSinceFull++;
+    }
+    else
+    {
+      ForEach(_segmentsCount, &FaceFilterHistogramTransformData::PlaceSegmentRows);
+      if (_incremental)
+      {
+        _previousFrame.assign(data, data + width * height);
+        _framesSinceFull = 0;
+        _historyValid = true;
+      }
+    }
+
+    if (_useBitmaps)
+    {
+      BuildBitmaps();
+      if (_updateOnly)
+        MarkAffectedSegments();
+      if (_incremental)
+        std::copy(_occupancy, _occupancy + _segmentsTotal, _previousOccupancy);
+    }
+    else
+    {
+      TransposeHistogram();
+    }
+  }
+
+  void FaceFilterHistogramTransformData::UpdateSegmentRows(uint32_t begin, uint32_t end)
+  {
+    // Move every changed pixel from the counter of its old depth to the one of its new depth
+    for (uint32_t r = begin; r < end; ++r)
+    {
+      const uint16_t* row = _frame + _rowRunStarts[r] * _frameWidth;
+      uint16_t* previous = &_previousFrame[_rowRunStarts[r] * _frameWidth];
+      for (uint32_t y = _rowRunStarts[r]; y < _rowRunStarts[r + 1]; ++y, row += _frameWidth, previous += _frameWidth)
+      {
+        uint16_t* counters = _binnedSegments + r * _segmentsCount * _binStride;
+        for (uint32_t s = 0; s < _segmentsCount; ++s, counters += _binStride)
+        {
+          for (uint32_t x = _columnRunStarts[s]; x < _columnRunStarts[s + 1]; ++x)
+          {
+            if (row[x] != previous[x])
+            {
+              counters[_depthToLayer[previous[x]]] --;
+              counters[_depthToLayer[row[x]]] ++;
+              previous[x] = row[x];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  void FaceFilterHistogramTransformData::MarkAffectedSegments()
+  {
+    // A segment's score only depends on the occupancy under its mask, so it has to be
+    // scored again if any segment within the mask's reach changed occupancy.
+    const int32_t padding = _mask._lengthOneSide / 2;
+    const int32_t segments = static_cast<int32_t>(_segmentsCount);
+    std::fill(_affected, _affected + _segmentsTotal, 0);
+    for (int32_t y = 0; y < segments; ++y)
+    {
+      for (int32_t x = 0; x < segments; ++x)
+      {
+        if (_occupancy[y * segments + x] == _previousOccupancy[y * segments + x])
+          continue;
+        // Segment (x, y) is under the mask tap (x - cx + padding, ...) of segment (cx, cy)
+        for (int32_t cy = std::max(0, y + padding - _mask._lengthOneSide + 1); cy <= std::min(segments - 1, y + padding); ++cy)
+          for (int32_t cx = std::max(0, x + padding - _mask._lengthOneSide + 1); cx <= std::min(segments - 1, x + padding); ++cx)
+            _affected[cy * segments + cx] = 1;
+      }
+    }
+  }
+
+  void FaceFilterHistogramTransformData::PlaceSegmentRows(uint32_t begin, uint32_t end)
+  {
+    for (uint32_t r = begin; r < end; ++r)
+    {
+      const uint16_t* row = _frame + _rowRunStarts[r] * _frameWidth;
+      for (uint32_t y = _rowRunStarts[r]; y < _rowRunStarts[r + 1]; ++y, row += _frameWidth)
+      {
+        uint16_t* counters = _binnedSegments + r * _segmentsCount * _binStride;
+        for (uint32_t s = 0; s < _segmentsCount; ++s, counters += _binStride)
+        {
+          // Pixels without depth are counted in the spare counter, which saves a branch
+          for (uint32_t x = _columnRunStarts[s]; x < _columnRunStarts[s + 1]; ++x)
+          {
+            counters[_depthToLayer[row[x]]] ++;
+          }
+        }
+      }
+    }
+  }
+
+  void FaceFilterHistogramTransformData::BuildBitmaps()
+  {
+    const uint32_t padding = _mask._lengthOneSide / 2;
+    std::fill(_rowBitmaps, _rowBitmaps + _layersCount * _bitmapRows, 0);
+
+    const uint16_t* counters = _binnedSegments;
+    uint64_t* occupancy = _occupancy;
+    for (uint32_t y = 0; y < _segmentsCount; ++y)
+    {
+      for (uint32_t x = 0; x < _segmentsCount; ++x, counters += _binStride)
+      {
+        const uint64_t column = 1ULL << (x + padding);
+        uint64_t* rows = _rowBitmaps + y + padding;
+        uint64_t word = 0;
+        for (uint32_t j = 0; j < _layersCount; ++j, rows += _bitmapRows)
+        {
+          if (counters[j] != 0)
+          {
+            word |= 1ULL << j;
+            *rows |= column;
+          }
+        }
+        *occupancy++ = word;
+      }
+    }
+
+    // OR the occupancy over the mask's bounding box, rows first and then columns. A layer
+    // can only score above the threshold where some positive tap covers an occupied segment.
+    const int32_t segments = static_cast<int32_t>(_segmentsCount);
+    const int32_t from = -static_cast<int32_t>(padding);
+    const int32_t to = static_cast<int32_t>(_mask._lengthOneSide - padding);
+    for (int32_t y = 0; y < segments; ++y)
+    {
+      for (int32_t x = 0; x < segments; ++x)
+      {
+        uint64_t word = 0;
+        for (int32_t tx = std::max(0, x + from); tx < std::min(segments, x + to); ++tx)
+          word |= _occupancy[y * segments + tx];
+        _rowCandidates[y * segments + x] = word;
+      }
+    }
+    for (int32_t y = 0; y < segments; ++y)
+    {
+      for (int32_t x = 0; x < segments; ++x)
+      {
+        uint64_t word = 0;
+        for (int32_t ty = std::max(0, y + from); ty < std::min(segments, y + to); ++ty)
+          word |= _rowCandidates[ty * segments + x];
+        _candidates[y * segments + x] = word;
+      }
+    }
+  }
+
+  void FaceFilterHistogramTransformData::ApplyMaskBitmaps()
+  {
+    // Same result as scoring layer by layer: the first and the last layers are ignored and a
+    // segment gets the highest layer scoring above the threshold. Layers are tried top-down,
+    // so the first hit ends the search. The negative part of the mask is worth at most half
+    // of _maxScore, so a layer without any occupied segment under the positive part can
+    // never pass and only candidate layers are scored.
+    ForEach(_segmentsCount, &FaceFilterHistogramTransformData::ScoreSegmentRows);
+  }
+
+  void FaceFilterHistogramTransformData::ScoreSegmentRows(uint32_t begin, uint32_t end)
+  {
+    const uint64_t layersOfInterest = _layersCount < 3 ? 0 : ((1ULL << (_layersCount - 1)) - 1) & ~1ULL;
+    const uint16_t lengthOneSide = _mask._lengthOneSide;
+
+    uint32_t index = begin * _segmentsCount;
+    for (uint32_t y = begin; y < end; ++y) {
+      for (uint32_t x = 0; x < _segmentsCount; ++x, ++index) {
+        if (_updateOnly && !_affected[index])
+          continue;
+
+        char decision = 0;
+        uint64_t candidates = _candidates[index] & layersOfInterest;
+        while (candidates != 0)
+        {
+          const uint32_t j = HighestBit(candidates);
+          candidates &= ~(1ULL << j);
+
+          // Padded row y + my holds segment row y + my - padding, and mask column mx lands
+          // on bit x + mx.
+          const uint64_t* rows = _rowBitmaps + j * _bitmapRows + y;
+          uint32_t positiveOccupied = 0;
+          uint32_t negativeOccupied = 0;
+          for (uint16_t my = 0; my < lengthOneSide; ++my)
+          {
+            positiveOccupied += PopCount(rows[my] & (_mask._positiveRows[my] << x));
+            negativeOccupied += PopCount(rows[my] & (_mask._negativeRows[my] << x));
+          }
+
+          const uint16_t score = static_cast<uint16_t>(_mask._positiveScore * positiveOccupied + _mask._negativeScore * (_negativeInGrid[index] - negativeOccupied));
+          if (score > Mask::_maxScore * .78) {
+            decision = static_cast<char>(j);
+            break;
+          }
+        }
+        _decisions[index] = decision;
+      }
+    }
+  }
+
+  void FaceFilterHistogramTransformData::TransposeHistogram()
+  {
+    // Walk the output sequentially; the strided reads stay within the small binned block
+    uint16_t* cell = _layeredSegments;
+    for (uint32_t j = 0; j < _layersCount; ++j)
+    {
+      const uint16_t* counter = _binnedSegments + j;
+      for (uint32_t i = 0; i < _segmentsTotal; ++i, counter += _binStride)
+      {
+        *cell++ = *counter;
       }
     }
   }
@@ -187,122 +823,182 @@ namespace freenect_camera
     return result;
   }
 
-  void FaceFilterHistogramTransformData::PlacePoint(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint16_t value)
+  void FaceFilterHistogramTransformData::ApplyMask()
   {
-    if (value > 0)
+    if (_useBitmaps)
     {
-      const uint32_t segmentIndex = GetSegmentIndex(x, y, width, height);
-      const uint32_t layer = DepthToLayer(value);
-
-      _layeredSegments[layer][segmentIndex] ++;
+      ApplyMaskBitmaps();
+      std::copy(_decisions, _decisions + _segmentsTotal, _segmentFilter);
+      return;
     }
-  }
 
-  void FaceFilterHistogramTransformData::ApplyMask()
-  {
     // The first and the last layers are ignored
     // TODO: has a matrix with layers of interest, based on some criteria (like having at least radiusMax not empty sequential points)
-    for (uint32_t j = 1; j < _layeredSegments.size() - 1; ++j)
-    {
-      Trace("layer", _layeredSegments[j], _segmentsCount, _segmentsCount, j);
-      std::vector<uint16_t> scores(_segmentsCount * _segmentsCount);
-      ApplyMask(_layeredSegments[j], _mask, scores);
+    if (_layersCount > 2)
+      ForEach(_layersCount - 2, &FaceFilterHistogramTransformData::ScoreLayers);
 
+    // Reduce in layer order, so the result and the traces do not depend on scheduling
+    for (uint32_t j = 1; j < _layersCount - 1; ++j)
+    {
+      const uint16_t* scores = _layerScores + j * _segmentsTotal;
+      Trace("layer", Layer(j), _segmentsCount, _segmentsCount, j);
       Trace("score", scores, _segmentsCount, _segmentsCount, j);
 
-      for (uint16_t i = 0; i < scores.size(); ++i){
+      for (uint32_t i = 0; i < _segmentsTotal; ++i){
         if (scores[i] > Mask::_maxScore * .78) {
           _segmentFilter[i] = std::max(_segmentFilter[i], static_cast<char>(j));
         }
       }
       Trace("segmentFilter", _segmentFilter, _segmentsCount, _segmentsCount, j);
     }
+  }
 
+  void FaceFilterHistogramTransformData::ApplySelection()
+  {
     _mask.ApplySelection(_segmentFilter, _segmentsCount, _layersCount);
     Trace("segmentSelection", _segmentFilter, _segmentsCount, _segmentsCount, 0);
   }
 
-  void FaceFilterHistogramTransformData::ApplyMask(const std::vector<uint16_t>& layer, const Mask& mask, std::vector<uint16_t>& scores)
+  void FaceFilterHistogramTransformData::ScoreLayers(uint32_t begin, uint32_t end)
   {
+    const uint32_t integralSize = (_integralSide + 1) * (_integralSide + 1);
+    for (uint32_t j = begin + 1; j < end + 1; ++j)
+    {
+      ApplyMask(Layer(j), _mask, _layerIntegrals + j * integralSize, _layerScores + j * _segmentsTotal);
+    }
+  }
+
+  void FaceFilterHistogramTransformData::ApplyMask(const uint16_t* layer, const Mask& mask, uint32_t* integral, uint16_t* scores)
+  {
+    // Every positive tap over an occupied segment adds _positiveScore and every negative tap
+    // over an empty in-grid segment adds _negativeScore, so the score only depends on how
+    // many segments under each part of the mask are occupied.
+    BuildIntegral(layer, mask._lengthOneSide / 2, integral);
+
     uint32_t index = 0;
     for (uint32_t y = 0; y < _segmentsCount; ++y) {
       for (uint32_t x = 0; x < _segmentsCount; ++x) {
         assert((index == y * _segmentsCount + x) && "Index must be always increasing by 1.");
-        uint16_t score = 0;
-        uint16_t centerOffset = mask._lengthOneSide / 2;
-        int32_t maskIndex = 0;
-        for (uint16_t my = 0; my < mask._lengthOneSide; ++my) {
-          for (uint16_t mx = 0; mx < mask._lengthOneSide; ++mx) {
-            int32_t tx = x + mx - centerOffset;
-            int32_t ty = y + my - centerOffset;
-            int32_t tIndex = ty * _segmentsCount + tx;
-            assert((maskIndex == my * _mask._lengthOneSide + mx) && "Index must be always increasing by 1.");
-            const int32_t segmentsCount = static_cast<int32_t>(_segmentsCount);
-
-            if (tx >= 0 && tx < segmentsCount && ty >= 0 && ty < segmentsCount){
-              if (mask._matrix[maskIndex] > 0 && layer[tIndex] != 0) {
-                score += mask._matrix[maskIndex];
-              }
-              else if (mask._matrix[maskIndex] < 0 && layer[tIndex] == 0) {
-                score -= mask._matrix[maskIndex];
-              }
-            }
-            maskIndex++;
-          }
-        }
-        scores[index] = score;
+        uint32_t positiveOccupied = 0;
+        for (size_t r = 0; r < mask._positiveRects.size(); ++r)
+          positiveOccupied += CountOccupied(integral, x, y, mask._positiveRects[r]);
+        uint32_t negativeOccupied = 0;
+        for (size_t r = 0; r < mask._negativeRects.size(); ++r)
+          negativeOccupied += CountOccupied(integral, x, y, mask._negativeRects[r]);
+
+        scores[index] = static_cast<uint16_t>(mask._positiveScore * positiveOccupied + mask._negativeScore * (_negativeInGrid[index] - negativeOccupied));
         index++;
       }
     }
   }
 
-  inline uint32_t FaceFilterHistogramTransformData::GetSegmentIndex(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+  void FaceFilterHistogramTransformData::BuildIntegral(const uint16_t* layer, uint32_t padding, uint32_t* integral)
   {
-    const uint32_t xSegment = x * _segmentsCount / width;
-    const uint32_t ySegment = y * _segmentsCount / height;
-    uint32_t segmentIndex = ySegment * _segmentsCount + xSegment;
-    assert(segmentIndex < _segmentsCount * _segmentsCount);
+    // Rows and columns of padding around the grid stay empty; below and right of the grid
+    // they still have to carry the sums forward.
+    const uint32_t stride = _integralSide + 1;
+    for (uint32_t py = 0; py < _integralSide; ++py)
+    {
+      const uint32_t* above = integral + py * stride;
+      uint32_t* current = integral + (py + 1) * stride;
+      uint32_t rowSum = 0;
+      if (py >= padding && py < padding + _segmentsCount)
+      {
+        const uint16_t* segments = layer + (py - padding) * _segmentsCount;
+        for (uint32_t px = 0; px < _integralSide; ++px)
+        {
+          if (px >= padding && px < padding + _segmentsCount && segments[px - padding] != 0)
+            rowSum++;
+          current[px + 1] = above[px + 1] + rowSum;
+        }
+      }
+      else
+      {
+        std::copy(above + 1, above + stride, current + 1);
+      }
+    }
+  }
 
-    return segmentIndex;
+  inline uint32_t FaceFilterHistogramTransformData::CountOccupied(const uint32_t* integral, uint32_t x, uint32_t y, const MaskRect& rect) const
+  {
+    // Segment (x, y) sits at padded (x + padding, y + padding), so mask tap (mx, my) lands on
+    // padded (x + mx, y + my).
+    const uint32_t stride = _integralSide + 1;
+    const uint32_t* top = integral + (y + rect.y0) * stride + x;
+    const uint32_t* bottom = integral + (y + rect.y1) * stride + x;
+    return bottom[rect.x1] - bottom[rect.x0] - top[rect.x1] + top[rect.x0];
   }
 
   void FaceFilterHistogramTransformData::FilterDepthData(uint32_t width, uint32_t height, uint16_t* data)
   {
-    uint32_t index = 0;
-    for (uint32_t y = 0; y < height; ++y)
+    for (uint32_t i = 0; i < _segmentsTotal; ++i)
+    {
+      uint32_t layerValueCoded = _segmentFilter[i];
+      uint32_t layer = layerValueCoded > _layersCount ? layerValueCoded - _layersCount : layerValueCoded;
+      _maxAllowedDepth[i] = layer == 0 ? 0U : static_cast<uint16_t>(LayerToDepth(layer + 1));
+    }
+
+    assert(width == _tableWidth && height == _tableHeight && "PrepareTables() must be called first.");
+    _frameWidth = width;
+    _frame = data;
+    ForEach(_segmentsCount, &FaceFilterHistogramTransformData::ClampSegmentRows);
+  }
+
+  void FaceFilterHistogramTransformData::ClampSegmentRows(uint32_t begin, uint32_t end)
+  {
+    // All rows of a segment row share the same thresholds, so they are expanded into a
+    // row span once and every row is then clamped in one straight pass.
+    for (uint32_t r = begin; r < end; ++r)
     {
-      for (uint32_t x = 0; x < width; ++x)
+      uint16_t* span = &_rowMaxAllowedDepth[r * _frameWidth];
+      const uint16_t* maxAllowed = _maxAllowedDepth + r * _segmentsCount;
+      for (uint32_t s = 0; s < _segmentsCount; ++s)
       {
-        uint32_t segmentIndex = GetSegmentIndex(x, y, width, height);
-        uint32_t layerValueCoded = _segmentFilter[segmentIndex];
-        uint32_t layer = layerValueCoded > _layersCount ? layerValueCoded - _layersCount : layerValueCoded;
-        uint16_t maxAllowedValue = layer == 0 ? 0U : static_cast<uint16_t>(LayerToDepth(layer + 1));
-        data[index] = data[index] > maxAllowedValue ? 0U : data[index];
-        assert((index == y * width + x) && "Index must be always increasing by 1.");
-        index++;
+        std::fill(span + _columnRunStarts[s], span + _columnRunStarts[s + 1], maxAllowed[s]);
+      }
+
+      uint16_t* row = _frame + _rowRunStarts[r] * _frameWidth;
+      for (uint32_t y = _rowRunStarts[r]; y < _rowRunStarts[r + 1]; ++y, row += _frameWidth)
+      {
+        FaceFilter::ClampDepth(span, row, _frameWidth);
       }
     }
   }
 
   template<typename T>
-  void FaceFilterHistogramTransformData::Trace(const std::string& name, const std::vector<T>& data, uint32_t width, uint32_t height, uint32_t counter)
+  void FaceFilterHistogramTransformData::Trace(const char* name, const std::vector<T>& data, uint32_t width, uint32_t height, uint32_t counter)
   {
     assert(data.size() <= width * height && "width and height are invalid for this vector.");
     Trace(name, data.data(), width, height, counter);
   }
 
+  template<typename T> struct TraceValueTypeOf;
+  template<> struct TraceValueTypeOf<char> { static const TraceSink::ValueType Value = TraceSink::Int8; };
+  template<> struct TraceValueTypeOf<int16_t> { static const TraceSink::ValueType Value = TraceSink::Int16; };
+  template<> struct TraceValueTypeOf<uint16_t> { static const TraceSink::ValueType Value = TraceSink::UInt16; };
+
   template<typename T>
-  void FaceFilterHistogramTransformData::Trace(const std::string& name, const T* data, const uint32_t width, const uint32_t height, const uint32_t counter)
+  void FaceFilterHistogramTransformData::Trace(const char* name, const T* data, const uint32_t width, const uint32_t height, const uint32_t counter)
   {
-    if (!_tracingEnabled)
+    if (_traceSink == NULL)
       return;
 
+    _traceSink->Write(name, _frameIndex, counter, TraceValueTypeOf<T>::Value, data, width, height);
+  }
+
+  CsvTraceSink::CsvTraceSink(const std::string& fileNameBase)
+    : _fileNameBase(fileNameBase)
+  {
+  }
+
+  void CsvTraceSink::Write(const char* name, uint64_t /*frame*/, uint32_t counter, ValueType type, const void* data, uint32_t width, uint32_t height)
+  {
     char buffer[1024] = { '\0' };
     int stringLength = sprintf(buffer,
       "%s_%02d_%s.csv",
-      _fileNameBaseTrace.c_str(),
+      _fileNameBase.c_str(),
       counter,
-      name.c_str()
+      name
     );
 
     if (stringLength <= 0) {
@@ -310,11 +1006,31 @@ namespace freenect_camera
       return;
     }
 
-    FaceFilter::SaveDataAsCsv(width, height, data, std::string(buffer, stringLength));
+    const std::string filePath(buffer, stringLength);
+    switch (type)
+    {
+    case Int8:
+      FaceFilter::SaveDataAsCsv(width, height, static_cast<const char*>(data), filePath);
+      break;
+    case Int16:
+      FaceFilter::SaveDataAsCsv(width, height, static_cast<const int16_t*>(data), filePath);
+      break;
+    case UInt16:
+      FaceFilter::SaveDataAsCsv(width, height, static_cast<const uint16_t*>(data), filePath);
+      break;
+    }
   }
 
   FaceFilterHistogramTransform::FaceFilterHistogramTransform(uint32_t layersCount, uint32_t segmentsCount, uint32_t depthMax, bool tracingEnabled, const std::string& fileNameBaseTrace)
-    : _data(new FaceFilterHistogramTransformData(layersCount, segmentsCount, depthMax, tracingEnabled, fileNameBaseTrace))
+    : _stageTimings(NULL)
+    , _csvTraceSink(tracingEnabled ? new CsvTraceSink(fileNameBaseTrace) : NULL)
+    , _data(new FaceFilterHistogramTransformData(layersCount, segmentsCount, depthMax, _csvTraceSink.get()))
+  {
+  }
+
+  FaceFilterHistogramTransform::FaceFilterHistogramTransform(uint32_t layersCount, uint32_t segmentsCount, uint32_t depthMax, TraceSink* traceSink)
+    : _stageTimings(NULL)
+    , _data(new FaceFilterHistogramTransformData(layersCount, segmentsCount, depthMax, traceSink))
   {
   }
 
@@ -322,16 +1038,100 @@ namespace freenect_camera
   {
   }
 
+  void FaceFilterHistogramTransform::SetParallelFor(ParallelFor* parallelFor)
+  {
+    _data->SetParallelFor(parallelFor);
+  }
+
+  void FaceFilterHistogramTransform::SetIncremental(bool enabled, uint32_t fullRecomputeInterval)
+  {
+    _data->SetIncremental(enabled, fullRecomputeInterval);
+  }
+
   void FaceFilterHistogramTransform::Transform(uint32_t width, uint32_t height, uint16_t* data)
   {
     if (data == NULL)
       return;
 
+    FaceFilterStageTimer timer(_stageTimings);
+    _data->BeginFrame(width, height);
+
     _data->PlacePoints(width, height, data);
+    timer.Stop(&FaceFilterStageTimings::placePointsNs);
 
     _data->ApplyMask();
+    timer.Stop(&FaceFilterStageTimings::applyMaskNs);
+
+    _data->ApplySelection();
+    timer.Stop(&FaceFilterStageTimings::applySelectionNs);
 
     _data->FilterDepthData(width, height, data);
+    timer.Stop(&FaceFilterStageTimings::filterDepthDataNs);
+    timer.EndFrame();
+  }
+
+  void FaceFilterHistogramTransform::SetStageTimings(FaceFilterStageTimings* timings)
+  {
+    _stageTimings = timings;
+  }
+
+  uint64_t FaceFilterClockNs()
+  {
+#ifdef _MSC_VER
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0)
+      ::QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER counter;
+    ::QueryPerformanceCounter(&counter);
+    return static_cast<uint64_t>(counter.QuadPart / frequency.QuadPart * 1000000000ULL + counter.QuadPart % frequency.QuadPart * 1000000000ULL / frequency.QuadPart);
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+#endif
+  }
+
+  boost::shared_ptr<DepthDataTransform> CreateFaceFilterTransform(uint32_t layersCount, uint32_t segmentsCount, uint32_t depthMax, bool fixed)
+  {
+    // Every instantiation costs code size, so only common configurations get one
+    if (fixed && layersCount == 30 && segmentsCount == 20)
+      return boost::shared_ptr<DepthDataTransform>(new FixedFaceFilterHistogramTransform<30, 20, 5, 1>(depthMax));
+    return boost::shared_ptr<DepthDataTransform>(new FaceFilterHistogramTransform(layersCount, segmentsCount, depthMax));
+  }
+
+  void FaceFilter::ClampDepth(const uint16_t* maxAllowed, uint16_t* data, uint32_t count)
+  {
+    uint32_t i = 0;
+    // There is no unsigned 16-bit compare before AVX-512, but a saturated subtraction
+    // is zero exactly when the value is within its limit.
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 16 <= count; i += 16)
+    {
+      const __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+      const __m256i limit = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(maxAllowed + i));
+      const __m256i keep = _mm256_cmpeq_epi16(_mm256_subs_epu16(value, limit), zero);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), _mm256_and_si256(value, keep));
+    }
+#elif defined(FACE_FILTER_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8)
+    {
+      const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+      const __m128i limit = _mm_loadu_si128(reinterpret_cast<const __m128i*>(maxAllowed + i));
+      const __m128i keep = _mm_cmpeq_epi16(_mm_subs_epu16(value, limit), zero);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_and_si128(value, keep));
+    }
+#endif
+    ClampDepthScalar(maxAllowed + i, data + i, count - i);
+  }
+
+  void FaceFilter::ClampDepthScalar(const uint16_t* maxAllowed, uint16_t* data, uint32_t count)
+  {
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      data[i] = data[i] > maxAllowed[i] ? 0U : data[i];
+    }
   }
 
   std::string FaceFilter::GenerateTempFilePath()
@@ -352,4 +1152,137 @@ namespace freenect_camera
       );
     return std::string(buffer);
   }
+
+  BOOST_STATIC_ASSERT(sizeof(FrameFileHeader) == 32);
+
+  namespace
+  {
+    // 0 for pixel types MappedFrame does not know
+    size_t FramePixelSize(uint16_t pixelType)
+    {
+      switch (pixelType)
+      {
+      case FrameFileHeader::PixelDepthUInt16:
+        return sizeof(uint16_t);
+      case FrameFileHeader::PixelBayerGrbgUInt8:
+        return sizeof(uint8_t);
+      default:
+        return 0;
+      }
+    }
+  }
+
+  void FaceFilter::SaveDataAsFrame(uint32_t width, uint32_t height, const uint16_t* data, const std::string& filePath, uint64_t timestamp)
+  {
+    SaveFrame(width, height, FrameFileHeader::PixelDepthUInt16, data, static_cast<size_t>(width) * height * sizeof(uint16_t), filePath, timestamp);
+  }
+
+  void FaceFilter::SaveDataAsFrame(uint32_t width, uint32_t height, const uint8_t* bayer, const std::string& filePath, uint64_t timestamp)
+  {
+    SaveFrame(width, height, FrameFileHeader::PixelBayerGrbgUInt8, bayer, static_cast<size_t>(width) * height, filePath, timestamp);
+  }
+
+  void FaceFilter::SaveFrame(uint32_t width, uint32_t height, uint16_t pixelType, const void* pixels, size_t pixelBytes, const std::string& filePath, uint64_t timestamp)
+  {
+    FrameFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "FRM1", 4);
+    header.headerSize = sizeof(FrameFileHeader);
+    header.pixelType = pixelType;
+    header.width = width;
+    header.height = height;
+    header.timestamp = timestamp;
+    header.byteOrder = 0x01020304;
+
+    std::ofstream ofs(filePath.c_str(), std::ofstream::out | std::ofstream::binary);
+    if (!ofs)
+      throw new std::runtime_error(std::string("Cannot open file for writing:") + filePath + std::string("."));
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(static_cast<const char*>(pixels), static_cast<std::streamsize>(pixelBytes));
+    if (!ofs)
+      throw new std::runtime_error(std::string("Cannot write file:") + filePath + std::string("."));
+  }
+
+  MappedFrame::MappedFrame(const std::string& filePath)
+    : _header(NULL)
+    , _size(0)
+  {
+#ifdef _MSC_VER
+    _mapping = NULL;
+    _file = ::CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (_file == INVALID_HANDLE_VALUE)
+      throw new std::runtime_error(std::string("Cannot open file for reading:") + filePath + std::string("."));
+    LARGE_INTEGER size;
+    if (::GetFileSizeEx(_file, &size))
+    {
+      _size = static_cast<size_t>(size.QuadPart);
+      _mapping = ::CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (_mapping != NULL)
+        _header = static_cast<const FrameFileHeader*>(::MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+#else
+    _file = ::open(filePath.c_str(), O_RDONLY);
+    if (_file < 0)
+      throw new std::runtime_error(std::string("Cannot open file for reading:") + filePath + std::string("."));
+    struct stat status;
+    if (::fstat(_file, &status) == 0 && status.st_size > 0)
+    {
+      _size = static_cast<size_t>(status.st_size);
+      void* address = ::mmap(NULL, _size, PROT_READ, MAP_PRIVATE, _file, 0);
+      if (address != MAP_FAILED)
+        _header = static_cast<const FrameFileHeader*>(address);
+    }
+#endif
+    if (_header == NULL)
+    {
+      Unmap();
+      throw new std::runtime_error(std::string("Cannot map file:") + filePath + std::string("."));
+    }
+
+    const char* error = NULL;
+    if (_size < sizeof(FrameFileHeader) || std::memcmp(_header->magic, "FRM1", 4) != 0)
+      error = "Not a frame file:";
+    else if (_header->byteOrder != 0x01020304)
+      error = "Frame file has a different byte order:";
+    else if (FramePixelSize(_header->pixelType) == 0 || _header->headerSize < sizeof(FrameFileHeader) || _header->headerSize % FramePixelSize(_header->pixelType) != 0)
+      error = "Unsupported frame file:";
+    else if (_size < _header->headerSize + static_cast<uint64_t>(_header->width) * _header->height * FramePixelSize(_header->pixelType))
+      error = "Frame file is truncated:";
+    if (error != NULL)
+    {
+      Unmap();
+      throw new std::runtime_error(std::string(error) + filePath + std::string("."));
+    }
+  }
+
+  MappedFrame::~MappedFrame()
+  {
+    Unmap();
+  }
+
+  size_t MappedFrame::PixelBytes() const
+  {
+    return static_cast<size_t>(_header->width) * _header->height * FramePixelSize(_header->pixelType);
+  }
+
+  void MappedFrame::Unmap()
+  {
+#ifdef _MSC_VER
+    if (_header != NULL)
+      ::UnmapViewOfFile(_header);
+    if (_mapping != NULL)
+      ::CloseHandle(_mapping);
+    if (_file != INVALID_HANDLE_VALUE)
+      ::CloseHandle(_file);
+    _mapping = NULL;
+    _file = INVALID_HANDLE_VALUE;
+#else
+    if (_header != NULL)
+      ::munmap(const_cast<FrameFileHeader*>(_header), _size);
+    if (_file >= 0)
+      ::close(_file);
+    _file = -1;
+#endif
+    _header = NULL;
+  }
 }
@@ -2,18 +2,108 @@
 #define FREENECT_CAMERA_FACE_FILTER_H
 
 #ifndef _MSC_VER
-// TODO:  Can it be removed at all?
-#include <ros/ros.h>
+// No ROS, so the filter and its tools build and run on their own
+#include <cassert>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
 #else
 #include "vs/common.h"
 #endif
 
 namespace freenect_camera {
 
+  // Lets a transform spread independent work over several threads. Run() calls body(context, begin, end)
+  // for disjoint ranges covering [0, count), possibly concurrently, and returns once all of them are done.
+  class ParallelFor
+  {
+  public:
+    typedef void (*Body)(void* context, uint32_t begin, uint32_t end);
+    virtual ~ParallelFor() {}
+    virtual void Run(uint32_t count, Body body, void* context) = 0;
+  };
+
+  // Time spent in the stages of the face filter, summed over the frames transformed while it is
+  // set. Stages done on several threads count the time until all of them are done.
+  struct FaceFilterStageTimings
+  {
+    FaceFilterStageTimings() : frames(0), placePointsNs(0), applyMaskNs(0), applySelectionNs(0), filterDepthDataNs(0) {}
+
+    uint64_t frames;
+    // Binning the pixels into segments and layers
+    uint64_t placePointsNs;
+    // Scoring the mask at every segment and layer
+    uint64_t applyMaskNs;
+    // Picking the layer kept per segment
+    uint64_t applySelectionNs;
+    // Clamping the depth data to the kept layers
+    uint64_t filterDepthDataNs;
+  };
+
+  // Monotonic time in nanoseconds
+  uint64_t FaceFilterClockNs();
+
+  // Adds the time between Stop() calls to the stages of timings, does nothing if it is NULL.
+  class FaceFilterStageTimer
+  {
+  public:
+    explicit FaceFilterStageTimer(FaceFilterStageTimings* timings)
+      : _timings(timings)
+      , _last(timings != NULL ? FaceFilterClockNs() : 0)
+    {
+    }
+
+    void Stop(uint64_t FaceFilterStageTimings::* stage)
+    {
+      if (_timings == NULL)
+        return;
+      const uint64_t now = FaceFilterClockNs();
+      _timings->*stage += now - _last;
+      _last = now;
+    }
+
+    void EndFrame()
+    {
+      if (_timings != NULL)
+        _timings->frames++;
+    }
+
+  private:
+    FaceFilterStageTimings* _timings;
+    uint64_t _last;
+  };
+
   class DepthDataTransform
   {
   public:
+    virtual ~DepthDataTransform() {}
     virtual void Transform(uint32_t width, uint32_t height, uint16_t* data) = 0;
+    // Transforms that can split their work over threads use parallelFor, the others ignore it.
+    virtual void SetParallelFor(ParallelFor* /*parallelFor*/) {}
+  };
+
+  // Receives snapshots of the intermediate face filter data while tracing. Write() is called on
+  // the filtering thread, one snapshot after the other, and data is only valid during the call.
+  class TraceSink
+  {
+  public:
+    enum ValueType { Int8 = 1, Int16 = 2, UInt16 = 3 };
+    virtual ~TraceSink() {}
+    virtual void Write(const char* name, uint64_t frame, uint32_t counter, ValueType type, const void* data, uint32_t width, uint32_t height) = 0;
+  };
+
+  // Saves every snapshot right away as <fileNameBase>_<counter>_<name>.csv. Easy to look at, but
+  // it writes dozens of files per frame; see FlightRecorder for something that keeps up.
+  class CsvTraceSink : public TraceSink
+  {
+  public:
+    explicit CsvTraceSink(const std::string& fileNameBase);
+    void Write(const char* name, uint64_t frame, uint32_t counter, ValueType type, const void* data, uint32_t width, uint32_t height);
+
+  private:
+    const std::string _fileNameBase;
   };
 
   struct FaceFilterHistogramTransformData;
@@ -22,13 +112,84 @@ namespace freenect_camera {
   {
   public:
     FaceFilterHistogramTransform(uint32_t layersCount = 30, uint32_t segmentsCount = 20, uint32_t depthMax = 4000, bool tracingEnabled = false, const std::string& fileNameBaseTrace = std::string());
+    // Traces into traceSink, which is not owned and must outlive the transform. Tracing always
+    // uses the per-layer mask engine, since that is where the traced data exists.
+    FaceFilterHistogramTransform(uint32_t layersCount, uint32_t segmentsCount, uint32_t depthMax, TraceSink* traceSink);
     void Transform(uint32_t width, uint32_t height, uint16_t* data);
+    // Splits the work of Transform() over parallelFor, or runs it on the calling thread if NULL.
+    // The result is the same either way. parallelFor is not owned and must outlive its use.
+    void SetParallelFor(ParallelFor* parallelFor);
+    // Keeps the histograms of the previous frame and only updates what changed, which is much
+    // cheaper for mostly static scenes. The output is the same as without it. A full pass is
+    // still done every fullRecomputeInterval frames. Only used with the bit-packed mask engine,
+    // i.e. without tracing and for up to 64 layers and a padded segment row of up to 64.
+    void SetIncremental(bool enabled, uint32_t fullRecomputeInterval = 30);
+    // Adds the time of every stage of Transform() to timings, NULL stops it. Not owned.
+    void SetStageTimings(FaceFilterStageTimings* timings);
     ~FaceFilterHistogramTransform();
 
   private:
+    FaceFilterStageTimings* _stageTimings;
+    // Set when tracing to CSV files, the data only keeps a pointer
+    boost::shared_ptr<TraceSink> _csvTraceSink;
     boost::shared_ptr<FaceFilterHistogramTransformData> _data;
   };
 
+  // Face filter with the default mask: FaceFilterHistogramTransform, or with fixed a
+  // FixedFaceFilterHistogramTransform when one is instantiated for these parameters. The fixed
+  // one is not faster on the bundled frame, so it is only used when asked for.
+  boost::shared_ptr<DepthDataTransform> CreateFaceFilterTransform(uint32_t layersCount = 30, uint32_t segmentsCount = 20, uint32_t depthMax = 4000, bool fixed = false);
+
+  // Binary frame file: this header, then width * height pixels of pixelType, row by row, in the
+  // byte order of the machine that wrote it. The header is 32 bytes, so the pixels are aligned
+  // when the file is mapped.
+  struct FrameFileHeader
+  {
+    // Depth in mm, or Bayer video with the GRBG pattern of the Kinect's RGB camera
+    enum { PixelDepthUInt16 = 1, PixelBayerGrbgUInt8 = 2 };
+
+    char magic[4];        // "FRM1"
+    uint16_t headerSize;  // sizeof(FrameFileHeader), offset of the pixels
+    uint16_t pixelType;
+    uint32_t width;
+    uint32_t height;
+    uint64_t timestamp;   // Nanoseconds since the epoch, 0 if unknown
+    uint32_t byteOrder;   // 0x01020304 as written, to catch foreign files
+    uint32_t reserved;
+  };
+
+  // A frame file mapped read-only into memory, so loading it costs no parsing or copying.
+  class MappedFrame
+  {
+  public:
+    explicit MappedFrame(const std::string& filePath);
+    ~MappedFrame();
+
+    uint32_t Width() const { return _header->width; }
+    uint32_t Height() const { return _header->height; }
+    uint64_t Timestamp() const { return _header->timestamp; }
+    uint16_t PixelType() const { return _header->pixelType; }
+    // The pixels of a PixelDepthUInt16 frame
+    const uint16_t* Data() const { return static_cast<const uint16_t*>(Pixels()); }
+    // The pixels whatever their type, PixelBytes() long
+    const void* Pixels() const { return reinterpret_cast<const char*>(_header) + _header->headerSize; }
+    size_t PixelBytes() const;
+
+  private:
+    MappedFrame(const MappedFrame&);
+    MappedFrame& operator=(const MappedFrame&);
+    void Unmap();
+
+    const FrameFileHeader* _header;
+    size_t _size;
+#ifdef _MSC_VER
+    void* _file;
+    void* _mapping;
+#else
+    int _file;
+#endif
+  };
+
   class FaceFilter
   {
   public:
@@ -39,8 +200,19 @@ namespace freenect_camera {
     template<typename T>
     static void LoadDataFromCsv(const std::string& filePath, uint32_t expectedWidth, uint32_t expectedHeight, T* data);
 
+    // Writes a frame file, see FrameFileHeader. Use MappedFrame to read it.
+    static void SaveDataAsFrame(uint32_t width, uint32_t height, const uint16_t* data, const std::string& filePath, uint64_t timestamp = 0);
+    // Same for a Bayer video frame.
+    static void SaveDataAsFrame(uint32_t width, uint32_t height, const uint8_t* bayer, const std::string& filePath, uint64_t timestamp = 0);
+
+    // Sets every data[i] greater than maxAllowed[i] to 0. Uses AVX2 or SSE2 when the build targets them.
+    static void ClampDepth(const uint16_t* maxAllowed, uint16_t* data, uint32_t count);
+    // Reference implementation of ClampDepth().
+    static void ClampDepthScalar(const uint16_t* maxAllowed, uint16_t* data, uint32_t count);
+
   private:
     static std::string GenerateTempFilePath();
+    static void SaveFrame(uint32_t width, uint32_t height, uint16_t pixelType, const void* pixels, size_t pixelBytes, const std::string& filePath, uint64_t timestamp);
   };
 
 }
@@ -1,8 +1,349 @@
 #include "face_filter.h"
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <boost/mpl/if.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/static_assert.hpp>
 
 namespace freenect_camera
 {
+  // Digit loops for the CSV helpers. They only handle integers, do not look at the locale and
+  // work on whole buffers instead of streams.
+  template<bool Signed>
+  struct CsvInteger
+  {
+    template<typename T> static bool IsNegative(T) { return false; }
+  };
+
+  template<>
+  struct CsvInteger<true>
+  {
+    template<typename T> static bool IsNegative(T value) { return value < 0; }
+  };
+
+  inline const char* CsvDigitPairs()
+  {
+    return
+      "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+      "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+      "8081828384858687888990919293949596979899";
+  }
+
+  // The eight digits of value < 10^8, first digit in the lowest byte, as numbers 0 to 9. The
+  // value is split into two lanes of four digits, those into lanes of two and those into single
+  // digits, each time dividing all lanes with one multiplication and shift instead of divisions.
+  inline uint64_t CsvDigits(uint32_t value)
+  {
+    uint64_t lanes = value / 10000 | static_cast<uint64_t>(value % 10000) << 32;
+    uint64_t high = ((lanes * 10486) >> 20) & 0x0000007F0000007FULL;
+    lanes = high | (lanes - high * 100) << 16;
+    high = ((lanes * 103) >> 10) & 0x000F000F000F000FULL;
+    return high | (lanes - high * 10) << 8;
+  }
+
+  // Writes value at out, which needs room for 21 characters, and returns the end. Values below
+  // 10^8, i.e. all depths, take a path without data dependent branches on little endian
+  // machines: all eight digits are produced and the significant ones stored at once.
+  template<typename T>
+  char* FormatCsvValue(T value, char* out)
+  {
+    // Dividing 32-bit values is much cheaper, and only 64-bit types need more
+    typedef typename boost::mpl::if_c<(sizeof(T) > 4), uint64_t, uint32_t>::type Magnitude;
+    const char* pairs = CsvDigitPairs();
+
+    Magnitude magnitude;
+    if (CsvInteger<std::numeric_limits<T>::is_signed>::IsNegative(value))
+    {
+      *out++ = '-';
+      magnitude = 0 - static_cast<Magnitude>(value);
+    }
+    else
+    {
+      magnitude = static_cast<Magnitude>(value);
+    }
+
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_X64) || defined(_M_IX86)
+    if (magnitude < 100000000)
+    {
+      // The leading zeros are the low bytes, so dropping them is a shift. The last digit is
+      // kept for 0.
+      const uint32_t v = static_cast<uint32_t>(magnitude);
+      const uint64_t digits = CsvDigits(v);
+#if defined(__GNUC__)
+      const uint32_t zeros = static_cast<uint32_t>(__builtin_ctzll(digits | 1ULL << 56)) / 8;
+#else
+      const uint32_t zeros = 7 - (v >= 10) - (v >= 100) - (v >= 1000) - (v >= 10000) - (v >= 100000) - (v >= 1000000) - (v >= 10000000);
+#endif
+      const uint64_t word = (digits + 0x3030303030303030ULL) >> (8 * zeros);
+      std::memcpy(out, &word, 8);
+      return out + 8 - zeros;
+    }
+#endif
+
+    char digits[20];
+    char* digit = digits + sizeof(digits);
+    while (magnitude >= 100)
+    {
+      const uint32_t pair = static_cast<uint32_t>(magnitude % 100) * 2;
+      magnitude /= 100;
+      *--digit = pairs[pair + 1];
+      *--digit = pairs[pair];
+    }
+    if (magnitude >= 10)
+    {
+      *--digit = pairs[magnitude * 2 + 1];
+      *--digit = pairs[magnitude * 2];
+    }
+    else
+    {
+      *--digit = static_cast<char>('0' + magnitude);
+    }
+    const size_t length = digits + sizeof(digits) - digit;
+    std::memcpy(out, digit, length);
+    return out + length;
+  }
+
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_X64) || defined(_M_IX86)
+  // "0," to "9999,", padded with 0s, with their length in the top byte. Most values in a
+  // trace or a depth frame are below 10^4, and copying them from here beats producing digits.
+  struct CsvShortValues
+  {
+    CsvShortValues()
+    {
+      for (uint32_t value = 0; value < 10000; ++value)
+      {
+        char text[24];
+        char* end = FormatCsvValue(value, text);
+        *end++ = ',';
+        values[value] = 0;
+        std::memcpy(&values[value], text, end - text);
+        values[value] |= static_cast<uint64_t>(end - text) << 56;
+      }
+    }
+
+    uint64_t values[10000];
+  };
+
+  inline const uint64_t* CsvShortValueTable()
+  {
+    static const CsvShortValues table;
+    return table.values;
+  }
+
+  // The value of two digits, from which '0' was subtracted, read as a 16-bit word
+  struct CsvDigitPairValues
+  {
+    CsvDigitPairValues()
+    {
+      std::memset(values, 0, sizeof(values));
+      for (uint32_t first = 0; first < 10; ++first)
+        for (uint32_t second = 0; second < 10; ++second)
+          values[first | second << 8] = static_cast<uint8_t>(first * 10 + second);
+    }
+
+    uint8_t values[0x0A0A];
+  };
+
+  inline const uint8_t* CsvDigitPairValueTable()
+  {
+    static const CsvDigitPairValues table;
+    return table.values;
+  }
+
+  // The value of the length < 8 digits at the start of chunk, from which '0' was subtracted
+  // in every byte: shift the digits to the top of the word and combine them pairwise, then
+  // in fours.
+  inline uint32_t CsvValueOfDigits(uint64_t chunk, uint32_t length)
+  {
+    chunk <<= 64 - 8 * length;
+    chunk = chunk * 10 + (chunk >> 8);
+    chunk = ((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)) + ((chunk >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))) >> 32;
+    return static_cast<uint32_t>(chunk);
+  }
+#endif
+
+  // Writes count values at out, separated by ',' and followed by '\n', and returns the end.
+  // out needs room for 22 characters per value.
+  template<typename T>
+  char* FormatCsvRow(const T* values, uint32_t count, char* out)
+  {
+    if (count == 0)
+    {
+      *out++ = '\n';
+      return out;
+    }
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_X64) || defined(_M_IX86)
+    const uint64_t* shortValues = CsvShortValueTable();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      // Negative values become large here and take the general path
+      const uint64_t value = static_cast<uint64_t>(values[i]);
+      if (value < 10000)
+      {
+        const uint64_t text = shortValues[value];
+        std::memcpy(out, &text, 8);
+        out += text >> 56;
+      }
+      else
+      {
+        out = FormatCsvValue(values[i], out);
+        *out++ = ',';
+      }
+    }
+#else
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      out = FormatCsvValue(values[i], out);
+      *out++ = ',';
+    }
+#endif
+    out[-1] = '\n';
+    return out;
+  }
+
+  // Parses a value of T at p, optionally preceded by blanks, and returns the end or NULL.
+  // The text has to go on for 8 more bytes with something that is not a digit, like
+  // terminating 0s, so the digits can be read without bounds checks.
+  template<typename T>
+  const char* ParseCsvValue(const char* p, T& value)
+  {
+    while (*p == ' ' || *p == '\t')
+      p++;
+    const bool negative = std::numeric_limits<T>::is_signed && *p == '-';
+    if (negative)
+      p++;
+
+    const char* first = p;
+    uint64_t magnitude = 0;
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_X64) || defined(_M_IX86)
+    // Up to 7 digits at once: find the first byte that is not a digit, shift the digits
+    // to the top of the word and combine them pairwise, then in fours.
+    uint64_t chunk;
+    std::memcpy(&chunk, p, 8);
+    chunk -= 0x3030303030303030ULL;
+    const uint64_t notDigit = ((chunk + 0x7676767676767676ULL) | chunk) & 0x8080808080808080ULL;
+    if (notDigit != 0 && (notDigit & 0xFFULL) == 0)
+    {
+#if defined(__GNUC__)
+      const uint32_t length = static_cast<uint32_t>(__builtin_ctzll(notDigit)) / 8;
+#else
+      uint32_t length = 0;
+      while (((notDigit >> (length * 8)) & 0x80) == 0)
+        length++;
+#endif
+      magnitude = CsvValueOfDigits(chunk, length);
+      p += length;
+    }
+    else
+#endif
+    {
+      // Up to 19 digits always fit, a 20th one only if it does not overflow
+      uint32_t digit;
+      while ((digit = static_cast<unsigned char>(*p - '0')) < 10 && p - first < 19)
+      {
+        magnitude = magnitude * 10 + digit;
+        p++;
+      }
+      if (digit < 10)
+      {
+        if (magnitude > (~0ULL - digit) / 10)
+          return NULL;
+        magnitude = magnitude * 10 + digit;
+        if (static_cast<unsigned char>(*++p - '0') < 10)
+          return NULL;
+      }
+    }
+
+    const uint64_t limit = negative
+      ? static_cast<uint64_t>(-(static_cast<int64_t>(std::numeric_limits<T>::min()) + 1)) + 1
+      : static_cast<uint64_t>(std::numeric_limits<T>::max());
+    if (p == first || magnitude > limit)
+      return NULL;
+
+    value = negative ? static_cast<T>(0 - magnitude) : static_cast<T>(magnitude);
+    return p;
+  }
+
+  // Parses a row of count values at p, up to and including its line end, and returns the end of
+  // the row. Only handles plain rows: values of 1 to 7 digits separated by ',', no blanks or
+  // signs. Returns NULL for anything else, which ParseCsvValue() then has to go through. Like
+  // there, the text has to go on for 8 more bytes with something that is not a digit.
+  //
+  // The separators are found a word at a time first, so where a value starts does not depend
+  // on parsing the one before it.
+  template<typename T>
+  const char* ParseCsvRow(const char* p, uint32_t count, T* values)
+  {
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_X64) || defined(_M_IX86)
+    if (count == 0)
+      return NULL;
+    const uint64_t limit = static_cast<uint64_t>(std::numeric_limits<T>::max());
+    const uint8_t* pairValues = CsvDigitPairValueTable();
+    T* const last = values + count - 1;
+    const char* start = p;
+    for (const char* word = p; ; word += 8)
+    {
+      // Every byte on its own: with the top bits set the subtraction cannot borrow from the
+      // next byte, and below 0x80 the addition cannot carry into it
+      uint64_t chunk;
+      std::memcpy(&chunk, word, 8);
+      const uint64_t belowZero = ~((chunk | 0x8080808080808080ULL) - 0x3030303030303030ULL);
+      const uint64_t aboveNine = (chunk & 0x7F7F7F7F7F7F7F7FULL) + 0x4646464646464646ULL;
+      uint64_t separators = (belowZero | aboveNine | chunk) & 0x8080808080808080ULL;
+      while (separators != 0)
+      {
+#if defined(__GNUC__)
+        const char* separator = word + __builtin_ctzll(separators) / 8;
+#else
+        uint32_t offset = 0;
+        while (((separators >> (offset * 8)) & 0x80) == 0)
+          offset++;
+        const char* separator = word + offset;
+#endif
+        separators &= separators - 1;
+
+        // Empty values wrap around too. Depths have up to 4 digits, which are looked up in
+        // pairs once they are moved to the top of the word.
+        const uint32_t length = static_cast<uint32_t>(separator - start);
+        uint64_t digits;
+        std::memcpy(&digits, start, 8);
+        digits -= 0x3030303030303030ULL;
+        uint32_t value;
+        if (length - 1 < 4)
+        {
+          digits <<= 64 - 8 * length;
+          value = pairValues[(digits >> 32) & 0xFFFF] * 100U + pairValues[digits >> 48];
+        }
+        else
+        {
+          if (length - 1 >= 7)
+            return NULL;
+          value = CsvValueOfDigits(digits, length);
+        }
+        if (value > limit)
+          return NULL;
+        *values = static_cast<T>(value);
+
+        if (values++ == last)
+        {
+          if (*separator == '\r')
+            separator++;
+          return *separator == '\n' ? separator + 1 : NULL;
+        }
+        if (*separator != ',')
+          return NULL;
+        start = separator + 1;
+      }
+    }
+#else
+    return NULL;
+#endif
+  }
+
   template<typename T>
   void FaceFilter::SaveDataAsCsv(uint32_t width, uint32_t height, const T* data)
   {
@@ -12,51 +353,91 @@ namespace freenect_camera
   template<typename T>
   void FaceFilter::SaveDataAsCsv(uint32_t width, uint32_t height, const T* data, const std::string& filePath)
   {
-    std::ofstream ofs(filePath.c_str(), std::ofstream::out);
-    for (uint32_t i = 0; i < width * height; ++i)
+    BOOST_STATIC_ASSERT(std::numeric_limits<T>::is_integer);
+
+    // Values are written as numbers, chars included. The text goes out in blocks of whole
+    // rows, which keeps the buffer small. An existing file is replaced rather than truncated,
+    // which takes longer than writing a frame on ext4.
+    std::remove(filePath.c_str());
+    std::ofstream ofs(filePath.c_str(), std::ofstream::out | std::ofstream::binary);
+    const size_t rowSize = static_cast<size_t>(width) * 22 + 1;
+    std::vector<char> block(std::max<size_t>(65536, rowSize));
+    char* out = &block[0];
+    for (uint32_t row = 0; row < height; ++row)
     {
-      ofs << data[i];
-      const char sep = ((i + 1) % width) ? ',' : '\n';
-      ofs << sep;
+      if (out > &block[0] + block.size() - rowSize)
+      {
+        ofs.write(&block[0], out - &block[0]);
+        out = &block[0];
+      }
+      out = FormatCsvRow(data + static_cast<size_t>(row) * width, width, out);
     }
+    ofs.write(&block[0], out - &block[0]);
     ofs.close();
   }
 
   template<typename T>
   void FaceFilter::LoadDataFromCsv(const std::string& filePath, uint32_t expectedWidth, uint32_t expectedHeight, T* data)
   {
-    std::ifstream ifs(filePath.c_str(), std::ifstream::in);
+    BOOST_STATIC_ASSERT(std::numeric_limits<T>::is_integer);
+
+    std::ifstream ifs(filePath.c_str(), std::ifstream::in | std::ifstream::binary);
     if (!ifs)
       throw new std::runtime_error(std::string("Cannot open file for reading:") + filePath + std::string("."));
 
-    std::string line;
+    ifs.seekg(0, std::ifstream::end);
+    const std::streamoff size = ifs.tellg();
+    ifs.seekg(0, std::ifstream::beg);
+    // Ends in 0s, which ParseCsvValue() relies on. Only those are cleared, the rest is read over.
+    boost::scoped_array<char> text(new char[static_cast<size_t>(size) + 8]);
+    std::memset(text.get() + size, 0, 8);
+    if (size > 0 && !ifs.read(text.get(), size))
+      throw new std::runtime_error(std::string("Cannot read file:") + filePath + std::string("."));
+
+    const char* p = text.get();
+    const char* end = p + size;
     size_t row = 0;
-    while (std::getline(ifs, line))
+    for (; row < expectedHeight && p != end; ++row)
     {
-      std::istringstream iss(line);
-      for (size_t column = 0; column < expectedWidth; ++column)
+      T* values = data + row * expectedWidth;
+      const char* next = ParseCsvRow(p, expectedWidth, values);
+      if (next != NULL && next <= end)
       {
-        uint16_t value;
-        char ch;
-        if (!(iss >> value))
-          throw new std::runtime_error("Too few column values.");
-
-        const size_t index = row * expectedWidth + column;
-        assert(index < expectedWidth * expectedWidth && "Reaching outside of array upper bound.");
-        data[index] = value;
+        p = next;
+        continue;
+      }
 
+      for (size_t column = 0; column < expectedWidth; ++column)
+      {
+        p = ParseCsvValue(p, values[column]);
+        if (p == NULL || p > end)
+          throw new std::runtime_error("Too few column values or value out of range.");
         if (column == expectedWidth - 1)
-          continue;
+          break;
 
-        if (!(iss >> ch))
-          throw new std::runtime_error("Cannot read separator.");
-        if (ch != ',')
-          throw new std::runtime_error("Separator is not ','.");
+        if (*p != ',')
+        {
+          while (p != end && (*p == ' ' || *p == '\t'))
+            p++;
+          if (p == end)
+            throw new std::runtime_error("Cannot read separator.");
+          if (*p != ',')
+            throw new std::runtime_error("Separator is not ','.");
+        }
+        p++;
       }
-      row++;
+
+      while (p != end && (*p == ' ' || *p == '\t'))
+        p++;
+      if (p != end && *p == '\r')
+        p++;
+      if (p != end && *p++ != '\n')
+        throw new std::runtime_error("Too many column values.");
     }
-    if (row != expectedHeight)
-      throw new std::runtime_error("Unexpected number of rows" + boost::lexical_cast<std::string>(row - 1) + ".");
 
+    while (p != end && (*p == '\r' || *p == '\n'))
+      p++;
+    if (row != expectedHeight || p != end)
+      throw new std::runtime_error("Unexpected number of rows" + boost::lexical_cast<std::string>(row) + ".");
   }
 }
@@ -0,0 +1,438 @@
+#ifndef FREENECT_CAMERA_FACE_FILTER_FIXED_HPP
+#define FREENECT_CAMERA_FACE_FILTER_FIXED_HPP
+
+#include "face_filter.h"
+#include <algorithm>
+#include <boost/static_assert.hpp>
+
+namespace freenect_camera
+{
+  inline uint32_t PopCount(uint64_t bits)
+  {
+#if defined(__GNUC__)
+    return static_cast<uint32_t>(__builtin_popcountll(bits));
+#else
+    bits = bits - ((bits >> 1) & 0x5555555555555555ULL);
+    bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<uint32_t>((bits * 0x0101010101010101ULL) >> 56);
+#endif
+  }
+
+  inline uint32_t HighestBit(uint64_t bits)
+  {
+    assert(bits != 0);
+#if defined(__GNUC__)
+    return 63U - static_cast<uint32_t>(__builtin_clzll(bits));
+#else
+    uint32_t result = 0;
+    while (bits >>= 1)
+      result++;
+    return result;
+#endif
+  }
+
+  // The mask of Mask::Mask(Diameter, InnerHole), generated by the compiler. Tap (X, Y) of the
+  // (Diameter + 2) x (Diameter + 2) mask is 1 on the ring, 2 outside of it and 0 in the hole.
+  // Its distance to the center is sqrt(Distance4) / 2, so comparing Distance4 with the squared
+  // diameters gives the same classes as the floating point version without leaving integers.
+  template<int Diameter, int InnerHole, int X, int Y>
+  struct FixedMaskTap
+  {
+    enum { Distance4 = (2 * X - 1 - Diameter) * (2 * X - 1 - Diameter) + (2 * Y - 1 - Diameter) * (2 * Y - 1 - Diameter) };
+    enum { Value = Distance4 >= InnerHole * InnerHole && Distance4 <= Diameter * Diameter ? 1 : (Distance4 >= Diameter * Diameter ? 2 : 0) };
+  };
+
+  // Bit X of row Y is set where the tap is of the given class.
+  template<int Diameter, int InnerHole, int Y, int Class, int X = Diameter + 1>
+  struct FixedMaskRow
+  {
+    static const uint64_t Value = (FixedMaskTap<Diameter, InnerHole, X, Y>::Value == Class ? 1ULL << X : 0ULL) | FixedMaskRow<Diameter, InnerHole, Y, Class, X - 1>::Value;
+  };
+
+  template<int Diameter, int InnerHole, int Y, int Class>
+  struct FixedMaskRow<Diameter, InnerHole, Y, Class, -1>
+  {
+    static const uint64_t Value = 0;
+  };
+
+  template<uint64_t Bits>
+  struct FixedPopCount
+  {
+    enum { Value = static_cast<int>(Bits & 1) + FixedPopCount<(Bits >> 1)>::Value };
+  };
+
+  template<>
+  struct FixedPopCount<0>
+  {
+    enum { Value = 0 };
+  };
+
+  // Rows of one class from row Y on: their tap count, and lookup by a row index the compiler
+  // can fold when it is a loop counter with fixed bounds.
+  template<int Diameter, int InnerHole, int Class, int Y = 0, int Length = Diameter + 2>
+  struct FixedMaskRows
+  {
+    enum { Count = FixedPopCount<FixedMaskRow<Diameter, InnerHole, Y, Class>::Value>::Value + FixedMaskRows<Diameter, InnerHole, Class, Y + 1, Length>::Count };
+
+    static uint64_t At(int y)
+    {
+      return y == Y ? FixedMaskRow<Diameter, InnerHole, Y, Class>::Value : FixedMaskRows<Diameter, InnerHole, Class, Y + 1, Length>::At(y);
+    }
+  };
+
+  template<int Diameter, int InnerHole, int Class, int Length>
+  struct FixedMaskRows<Diameter, InnerHole, Class, Length, Length>
+  {
+    enum { Count = 0 };
+    static uint64_t At(int) { return 0; }
+  };
+
+  // Occupied segments under the positive and the negative part of the mask, one row of
+  // bitmaps per mask row, fully unrolled.
+  template<int Diameter, int InnerHole, int Y = 0, int Length = Diameter + 2>
+  struct FixedMaskCount
+  {
+    static void Count(const uint64_t* rows, uint32_t x, uint32_t& positiveOccupied, uint32_t& negativeOccupied)
+    {
+      positiveOccupied += PopCount(rows[Y] & (FixedMaskRow<Diameter, InnerHole, Y, 1>::Value << x));
+      negativeOccupied += PopCount(rows[Y] & (FixedMaskRow<Diameter, InnerHole, Y, 2>::Value << x));
+      FixedMaskCount<Diameter, InnerHole, Y + 1, Length>::Count(rows, x, positiveOccupied, negativeOccupied);
+    }
+  };
+
+  template<int Diameter, int InnerHole, int Length>
+  struct FixedMaskCount<Diameter, InnerHole, Length, Length>
+  {
+    static void Count(const uint64_t*, uint32_t, uint32_t&, uint32_t&) {}
+  };
+
+  // FaceFilterHistogramTransform with the layer and segment counts and the mask fixed at
+  // compile time. The mask only exists as constants, all mask and grid loops have fixed
+  // bounds and every buffer is a plain array member. Gives the same output as the runtime
+  // class, whose bit-packed engine it mirrors, so it has the same limits: up to 64 layers and
+  // a segment row plus the mask reach of up to 64. There is no tracing or incremental mode.
+  // It is large (the depth to layer table alone is 64 KiB), so allocate it on the heap.
+  template<uint32_t Layers, uint32_t Segments, uint16_t MaskDiameter, uint16_t InnerHole>
+  class FixedFaceFilterHistogramTransform : public DepthDataTransform
+  {
+  public:
+    BOOST_STATIC_ASSERT(Layers >= 3 && Layers <= 64);
+    BOOST_STATIC_ASSERT(MaskDiameter > 0 && MaskDiameter + 2 < 64 && InnerHole <= MaskDiameter);
+    BOOST_STATIC_ASSERT(Segments > 0 && Segments + MaskDiameter + 1 <= 64);
+
+    explicit FixedFaceFilterHistogramTransform(uint32_t depthMax = 4000)
+      : _depthMax(depthMax)
+      , _tableWidth(0)
+      , _tableHeight(0)
+      , _parallelFor(NULL)
+      , _stageTimings(NULL)
+      , _frameWidth(0)
+      , _frame(NULL)
+    {
+      _depthToLayer[0] = Layers;
+      for (uint32_t depth = 1; depth < 65536; ++depth)
+      {
+        _depthToLayer[depth] = static_cast<uint8_t>(depth >= _depthMax ? Layers - 1 : depth * Layers / _depthMax);
+      }
+
+      // Same as FilterDepthData(): a segment keeps the depths up to the top of the layer
+      // above the one it was assigned, 0 means nothing is kept.
+      _layerLimit[0] = 0;
+      for (uint32_t layer = 1; layer < Layers; ++layer)
+      {
+        _layerLimit[layer] = static_cast<uint16_t>(layer + 1 == Layers ? _depthMax : (layer + 1) * _depthMax / Layers);
+      }
+
+      for (int32_t y = 0; y < static_cast<int32_t>(Segments); ++y) {
+        for (int32_t x = 0; x < static_cast<int32_t>(Segments); ++x) {
+          uint16_t count = 0;
+          for (int32_t my = 0; my < Length; ++my) {
+            const int32_t ty = y + my - Padding;
+            if (ty >= 0 && ty < static_cast<int32_t>(Segments))
+              count += static_cast<uint16_t>(PopCount(NegativeRows::At(my) & GridColumns(x)));
+          }
+          _negativeInGrid[y * Segments + x] = count;
+        }
+      }
+    }
+
+    // See FaceFilterHistogramTransform::SetParallelFor().
+    void SetParallelFor(ParallelFor* parallelFor) { _parallelFor = parallelFor; }
+    // See FaceFilterHistogramTransform::SetStageTimings().
+    void SetStageTimings(FaceFilterStageTimings* timings) { _stageTimings = timings; }
+
+    void Transform(uint32_t width, uint32_t height, uint16_t* data)
+    {
+      if (data == NULL)
+        return;
+
+      FaceFilterStageTimer timer(_stageTimings);
+      if (width != _tableWidth || height != _tableHeight)
+        PrepareTables(width, height);
+      _frameWidth = width;
+      _frame = data;
+
+      std::fill(_binnedSegments, _binnedSegments + SegmentsTotal * BinStride, 0);
+      ForEach(Segments, &FixedFaceFilterHistogramTransform::PlaceSegmentRows);
+      BuildBitmaps();
+      timer.Stop(&FaceFilterStageTimings::placePointsNs);
+      ForEach(Segments, &FixedFaceFilterHistogramTransform::ScoreSegmentRows);
+      timer.Stop(&FaceFilterStageTimings::applyMaskNs);
+      ApplySelection();
+      timer.Stop(&FaceFilterStageTimings::applySelectionNs);
+
+      for (uint32_t i = 0; i < SegmentsTotal; ++i)
+      {
+        const uint32_t layerValueCoded = _segmentFilter[i];
+        _maxAllowedDepth[i] = _layerLimit[layerValueCoded > Layers ? layerValueCoded - Layers : layerValueCoded];
+      }
+      ForEach(Segments, &FixedFaceFilterHistogramTransform::ClampSegmentRows);
+      timer.Stop(&FaceFilterStageTimings::filterDepthDataNs);
+      timer.EndFrame();
+    }
+
+  private:
+    static const int32_t Length = MaskDiameter + 2;
+    static const int32_t Padding = Length / 2;
+    static const uint32_t PaddedSide = Segments + Length - 1;
+    static const uint32_t SegmentsTotal = Segments * Segments;
+    static const uint32_t BinStride = Layers + 1;
+    static const uint16_t MaxScore = 20000;
+    // Mask::_maxScore * .78, which is exact
+    static const uint16_t Threshold = MaxScore / 100 * 78;
+    static const uint64_t LayersOfInterest = ((1ULL << (Layers - 1)) - 1) & ~1ULL;
+
+    typedef FixedMaskRows<MaskDiameter, InnerHole, 0> HoleRows;
+    typedef FixedMaskRows<MaskDiameter, InnerHole, 1> PositiveRows;
+    typedef FixedMaskRows<MaskDiameter, InnerHole, 2> NegativeRows;
+    static const int16_t PositiveScore = MaxScore / 2 / PositiveRows::Count;
+    static const int16_t NegativeScore = MaxScore / 2 / NegativeRows::Count;
+
+    // Bit mx is set where mask column mx lands inside the grid with the mask centered on
+    // segment column x, i.e. on column x + mx - Padding.
+    static uint64_t GridColumns(int32_t x)
+    {
+      const int32_t first = x < Padding ? Padding - x : 0;
+      const int32_t last = Padding - x + static_cast<int32_t>(Segments) < Length ? Padding - x + static_cast<int32_t>(Segments) : Length;
+      return ((1ULL << (last - first)) - 1) << first;
+    }
+
+    const uint32_t _depthMax;
+    uint8_t _depthToLayer[65536];
+    uint16_t _layerLimit[Layers];
+    uint16_t _negativeInGrid[SegmentsTotal];
+
+    uint16_t _binnedSegments[SegmentsTotal * BinStride];
+    uint64_t _occupancy[SegmentsTotal];
+    uint64_t _rowCandidates[SegmentsTotal];
+    uint64_t _candidates[SegmentsTotal];
+    uint64_t _rowBitmaps[Layers * PaddedSide];
+    char _segmentFilter[SegmentsTotal];
+    uint16_t _maxAllowedDepth[SegmentsTotal];
+
+    uint32_t _tableWidth;
+    uint32_t _tableHeight;
+    std::vector<uint32_t> _columnRunStarts;
+    std::vector<uint32_t> _rowRunStarts;
+    std::vector<uint16_t> _rowMaxAllowedDepth;
+
+    ParallelFor* _parallelFor;
+    FaceFilterStageTimings* _stageTimings;
+    uint32_t _frameWidth;
+    uint16_t* _frame;
+    typedef void (FixedFaceFilterHistogramTransform::*RangeMethod)(uint32_t begin, uint32_t end);
+    struct RangeCall
+    {
+      FixedFaceFilterHistogramTransform* self;
+      RangeMethod method;
+    };
+
+    static void CallRange(void* context, uint32_t begin, uint32_t end)
+    {
+      const RangeCall* call = static_cast<const RangeCall*>(context);
+      (call->self->*call->method)(begin, end);
+    }
+
+    void ForEach(uint32_t count, RangeMethod method)
+    {
+      if (_parallelFor == NULL)
+      {
+        (this->*method)(0, count);
+        return;
+      }
+
+      RangeCall call = { this, method };
+      _parallelFor->Run(count, &CallRange, &call);
+    }
+
+    void PrepareTables(uint32_t width, uint32_t height)
+    {
+      BuildRunStarts(width, _columnRunStarts);
+      BuildRunStarts(height, _rowRunStarts);
+      _rowMaxAllowedDepth.resize(Segments * width);
+
+      _tableWidth = width;
+      _tableHeight = height;
+    }
+
+    static void BuildRunStarts(uint32_t pixels, std::vector<uint32_t>& starts)
+    {
+      starts.assign(Segments + 1, pixels);
+      for (uint32_t p = pixels; p-- > 0;)
+      {
+        starts[p * Segments / pixels] = p;
+      }
+      for (uint32_t s = Segments; s-- > 0;)
+      {
+        starts[s] = std::min(starts[s], starts[s + 1]);
+      }
+    }
+
+    void PlaceSegmentRows(uint32_t begin, uint32_t end)
+    {
+      for (uint32_t r = begin; r < end; ++r)
+      {
+        const uint16_t* row = _frame + _rowRunStarts[r] * _frameWidth;
+        for (uint32_t y = _rowRunStarts[r]; y < _rowRunStarts[r + 1]; ++y, row += _frameWidth)
+        {
+          uint16_t* counters = _binnedSegments + r * Segments * BinStride;
+          for (uint32_t s = 0; s < Segments; ++s, counters += BinStride)
+          {
+            for (uint32_t x = _columnRunStarts[s]; x < _columnRunStarts[s + 1]; ++x)
+            {
+              counters[_depthToLayer[row[x]]] ++;
+            }
+          }
+        }
+      }
+    }
+
+    void BuildBitmaps()
+    {
+      std::fill(_rowBitmaps, _rowBitmaps + Layers * PaddedSide, 0);
+
+      const uint16_t* counters = _binnedSegments;
+      uint64_t* occupancy = _occupancy;
+      for (uint32_t y = 0; y < Segments; ++y)
+      {
+        for (uint32_t x = 0; x < Segments; ++x, counters += BinStride)
+        {
+          const uint64_t column = 1ULL << (x + Padding);
+          uint64_t* rows = _rowBitmaps + y + Padding;
+          uint64_t word = 0;
+          for (uint32_t j = 0; j < Layers; ++j, rows += PaddedSide)
+          {
+            if (counters[j] != 0)
+            {
+              word |= 1ULL << j;
+              *rows |= column;
+            }
+          }
+          *occupancy++ = word;
+        }
+      }
+
+      for (int32_t y = 0; y < static_cast<int32_t>(Segments); ++y)
+      {
+        for (int32_t x = 0; x < static_cast<int32_t>(Segments); ++x)
+        {
+          uint64_t word = 0;
+          for (int32_t tx = std::max(0, x - Padding); tx < std::min<int32_t>(Segments, x - Padding + Length); ++tx)
+            word |= _occupancy[y * Segments + tx];
+          _rowCandidates[y * Segments + x] = word;
+        }
+      }
+      for (int32_t y = 0; y < static_cast<int32_t>(Segments); ++y)
+      {
+        for (int32_t x = 0; x < static_cast<int32_t>(Segments); ++x)
+        {
+          uint64_t word = 0;
+          for (int32_t ty = std::max(0, y - Padding); ty < std::min<int32_t>(Segments, y - Padding + Length); ++ty)
+            word |= _rowCandidates[ty * Segments + x];
+          _candidates[y * Segments + x] = word;
+        }
+      }
+    }
+
+    void ScoreSegmentRows(uint32_t begin, uint32_t end)
+    {
+      uint32_t index = begin * Segments;
+      for (uint32_t y = begin; y < end; ++y) {
+        for (uint32_t x = 0; x < Segments; ++x, ++index) {
+          char decision = 0;
+          uint64_t candidates = _candidates[index] & LayersOfInterest;
+          while (candidates != 0)
+          {
+            const uint32_t j = HighestBit(candidates);
+            candidates &= ~(1ULL << j);
+
+            uint32_t positiveOccupied = 0;
+            uint32_t negativeOccupied = 0;
+            FixedMaskCount<MaskDiameter, InnerHole>::Count(_rowBitmaps + j * PaddedSide + y, x, positiveOccupied, negativeOccupied);
+
+            const uint16_t score = static_cast<uint16_t>(PositiveScore * positiveOccupied + NegativeScore * (_negativeInGrid[index] - negativeOccupied));
+            if (score > Threshold) {
+              decision = static_cast<char>(j);
+              break;
+            }
+          }
+          _segmentFilter[index] = decision;
+        }
+      }
+    }
+
+    void ApplySelection()
+    {
+      // Mask::ApplySelection() with the non-negative taps as row bits: empty segments under
+      // the ring or the hole of a selected segment are marked with its layer + Layers.
+      for (int32_t y = 0; y < static_cast<int32_t>(Segments); ++y) {
+        for (int32_t x = 0; x < static_cast<int32_t>(Segments); ++x) {
+          const uint32_t filterValue = _segmentFilter[y * Segments + x];
+          if (filterValue == 0 || filterValue >= Layers)
+            continue;
+
+          const char marked = static_cast<char>(filterValue + Layers);
+          const uint64_t columns = GridColumns(x);
+          for (int32_t my = 0; my < Length; ++my) {
+            const int32_t ty = y + my - Padding;
+            if (ty < 0 || ty >= static_cast<int32_t>(Segments))
+              continue;
+
+            // Bit mx stands for segment column x + mx - Padding
+            uint64_t taps = (HoleRows::At(my) | PositiveRows::At(my)) & columns;
+            char* target = _segmentFilter + ty * Segments + x - Padding;
+            while (taps != 0)
+            {
+              const uint32_t mx = HighestBit(taps);
+              taps &= ~(1ULL << mx);
+              if (target[mx] == 0)
+                target[mx] = marked;
+            }
+          }
+        }
+      }
+    }
+
+    void ClampSegmentRows(uint32_t begin, uint32_t end)
+    {
+      for (uint32_t r = begin; r < end; ++r)
+      {
+        uint16_t* span = &_rowMaxAllowedDepth[r * _frameWidth];
+        const uint16_t* maxAllowed = _maxAllowedDepth + r * Segments;
+        for (uint32_t s = 0; s < Segments; ++s)
+        {
+          std::fill(span + _columnRunStarts[s], span + _columnRunStarts[s + 1], maxAllowed[s]);
+        }
+
+        uint16_t* row = _frame + _rowRunStarts[r] * _frameWidth;
+        for (uint32_t y = _rowRunStarts[r]; y < _rowRunStarts[r + 1]; ++y, row += _frameWidth)
+        {
+          FaceFilter::ClampDepth(span, row, _frameWidth);
+        }
+      }
+    }
+  };
+}
+
+#endif // FREENECT_CAMERA_FACE_FILTER_FIXED_HPP
@@ -0,0 +1,239 @@
+#include "flight_recorder.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef _MSC_VER
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+namespace threading = std;
+#else
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+namespace threading = boost;
+#endif
+
+namespace freenect_camera
+{
+  namespace
+  {
+    const uint32_t RecordAlignment = 8;
+    // How long the writer sleeps when nobody wakes it up
+    const uint32_t WriterPeriodMs = 20;
+
+    uint32_t ValueSizeOf(TraceSink::ValueType type)
+    {
+      return type == TraceSink::Int8 ? 1 : 2;
+    }
+  }
+
+  struct FlightRecorderData
+  {
+    FlightRecorderData(const std::string& filePath, uint32_t capacityBytes);
+    ~FlightRecorderData();
+
+    void Push(const FlightRecordHeader& header, const void* values, uint32_t valuesSize);
+    void CopyIn(uint64_t position, const void* source, uint32_t size);
+    void WriterLoop();
+    void WriteOut(uint64_t begin, uint64_t end);
+
+    std::ofstream _file;
+    std::vector<char> _ring;
+    uint64_t _ringMask;
+
+    // Both only grow, the ring index is position & _ringMask. _head is only written by the
+    // producer, _tail only by the writer thread.
+    threading::atomic<uint64_t> _head;
+    threading::atomic<uint64_t> _tail;
+
+    threading::atomic<uint64_t> _dropped;
+    threading::atomic<uint64_t> _recorded;
+    // Drops since the last record that made it, only touched by the producer
+    uint32_t _droppedBefore;
+
+    threading::mutex _mutex;
+    threading::condition_variable _wakeUp;
+    bool _stopping;
+    threading::thread _writer;
+  };
+
+  FlightRecorderData::FlightRecorderData(const std::string& filePath, uint32_t capacityBytes)
+    : _file(filePath.c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc)
+    , _head(0)
+    , _tail(0)
+    , _dropped(0)
+    , _recorded(0)
+    , _droppedBefore(0)
+    , _stopping(false)
+  {
+    if (!_file)
+      throw new std::runtime_error(std::string("Cannot open file for writing:") + filePath + std::string("."));
+
+    uint64_t capacity = 4096;
+    while (capacity < capacityBytes)
+      capacity <<= 1;
+    _ring.resize(static_cast<size_t>(capacity));
+    _ringMask = capacity - 1;
+
+    FlightRecordFileHeader fileHeader;
+    std::memcpy(fileHeader.magic, "FTR1", 4);
+    fileHeader.headerSize = sizeof(FlightRecordHeader);
+    _file.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+
+    // Last, everything the thread uses is set up by now
+    _writer = threading::thread(&FlightRecorderData::WriterLoop, this);
+  }
+
+  FlightRecorderData::~FlightRecorderData()
+  {
+    {
+      threading::unique_lock<threading::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _wakeUp.notify_one();
+    _writer.join();
+  }
+
+  void FlightRecorderData::CopyIn(uint64_t position, const void* source, uint32_t size)
+  {
+    const size_t offset = static_cast<size_t>(position & _ringMask);
+    const size_t first = std::min<size_t>(size, _ring.size() - offset);
+    std::memcpy(&_ring[offset], source, first);
+    std::memcpy(&_ring[0], static_cast<const char*>(source) + first, size - first);
+  }
+
+  void FlightRecorderData::Push(const FlightRecordHeader& header, const void* values, uint32_t valuesSize)
+  {
+    const uint64_t head = _head.load(threading::memory_order_relaxed);
+    const uint64_t tail = _tail.load(threading::memory_order_acquire);
+    const uint64_t available = _ring.size() - (head - tail);
+    if (header.size > available)
+    {
+      _droppedBefore++;
+      _dropped.fetch_add(1, threading::memory_order_relaxed);
+      // Full, so the writer should be busy already, but make sure
+      _wakeUp.notify_one();
+      return;
+    }
+
+    CopyIn(head, &header, sizeof(header));
+    CopyIn(head + sizeof(header), values, valuesSize);
+    // Padding is left as is, readers skip it by size
+    _head.store(head + header.size, threading::memory_order_release);
+    _droppedBefore = 0;
+    _recorded.fetch_add(1, threading::memory_order_relaxed);
+
+    // Below half full the writer gets to it on its next period, which saves a wake up per
+    // snapshot on the filtering thread
+    if (available - header.size < _ring.size() / 2)
+      _wakeUp.notify_one();
+  }
+
+  void FlightRecorderData::WriteOut(uint64_t begin, uint64_t end)
+  {
+    while (begin != end)
+    {
+      const size_t offset = static_cast<size_t>(begin & _ringMask);
+      const size_t size = static_cast<size_t>(std::min<uint64_t>(end - begin, _ring.size() - offset));
+      _file.write(&_ring[offset], size);
+      begin += size;
+      // Hands the space back right away, so a long write does not hold up the producer
+      _tail.store(begin, threading::memory_order_release);
+    }
+  }
+
+  void FlightRecorderData::WriterLoop()
+  {
+    for (;;)
+    {
+      bool stopping;
+      {
+        threading::unique_lock<threading::mutex> lock(_mutex);
+        if (!_stopping && _head.load(threading::memory_order_acquire) == _tail.load(threading::memory_order_relaxed))
+        {
+#ifdef _MSC_VER
+          _wakeUp.wait_for(lock, std::chrono::milliseconds(WriterPeriodMs));
+#else
+          _wakeUp.timed_wait(lock, boost::posix_time::milliseconds(WriterPeriodMs));
+#endif
+        }
+        stopping = _stopping;
+      }
+
+      WriteOut(_tail.load(threading::memory_order_relaxed), _head.load(threading::memory_order_acquire));
+      if (stopping)
+        break;
+    }
+    _file.flush();
+  }
+
+  FlightRecorder::FlightRecorder(const std::string& filePath, uint32_t capacityBytes)
+    : _data(new FlightRecorderData(filePath, capacityBytes))
+  {
+  }
+
+  FlightRecorder::~FlightRecorder()
+  {
+  }
+
+  void FlightRecorder::Write(const char* name, uint64_t frame, uint32_t counter, ValueType type, const void* data, uint32_t width, uint32_t height)
+  {
+    const uint32_t valuesSize = width * height * ValueSizeOf(type);
+
+    FlightRecordHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.size = (sizeof(header) + valuesSize + RecordAlignment - 1) / RecordAlignment * RecordAlignment;
+    header.counter = counter;
+    header.frame = frame;
+    header.droppedBefore = _data->_droppedBefore;
+    header.valueType = static_cast<uint16_t>(type);
+    header.valueSize = static_cast<uint16_t>(ValueSizeOf(type));
+    header.width = width;
+    header.height = height;
+    std::strncpy(header.name, name, sizeof(header.name) - 1);
+
+    _data->Push(header, data, valuesSize);
+  }
+
+  uint64_t FlightRecorder::Dropped() const
+  {
+    return _data->_dropped.load();
+  }
+
+  uint64_t FlightRecorder::Recorded() const
+  {
+    return _data->_recorded.load();
+  }
+
+  void FlightRecorder::ReadFileHeader(std::istream& is)
+  {
+    FlightRecordFileHeader fileHeader;
+    if (!is.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader)) || std::memcmp(fileHeader.magic, "FTR1", 4) != 0)
+      throw new std::runtime_error("Not a flight recorder file.");
+    if (fileHeader.headerSize != sizeof(FlightRecordHeader))
+      throw new std::runtime_error("Unsupported flight recorder record header.");
+  }
+
+  bool FlightRecorder::ReadRecord(std::istream& is, FlightRecordHeader& header, std::vector<char>& values)
+  {
+    if (!is.read(reinterpret_cast<char*>(&header), sizeof(header)))
+      return false;
+
+    const uint64_t valuesSize = static_cast<uint64_t>(header.width) * header.height * header.valueSize;
+    if (header.size < sizeof(header) + valuesSize)
+      throw new std::runtime_error("Flight recorder record is corrupt.");
+
+    values.resize(static_cast<size_t>(valuesSize));
+    if (valuesSize > 0 && !is.read(&values[0], valuesSize))
+      throw new std::runtime_error("Flight recorder record is cut short.");
+    is.ignore(header.size - sizeof(header) - valuesSize);
+    return true;
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef FREENECT_CAMERA_FLIGHT_RECORDER_H
+#define FREENECT_CAMERA_FLIGHT_RECORDER_H
+
+#include "face_filter.h"
+#include <istream>
+
+namespace freenect_camera {
+
+  // Layout of the recorder files: FlightRecordFileHeader, then records of FlightRecordHeader
+  // followed by width * height * valueSize bytes of values, padded to 8 bytes. Little endian,
+  // as written by the machine that recorded them.
+  struct FlightRecordFileHeader
+  {
+    char magic[4];  // "FTR1"
+    uint32_t headerSize;  // sizeof(FlightRecordHeader)
+  };
+
+  struct FlightRecordHeader
+  {
+    uint32_t size;  // The whole record, header and padding included
+    uint32_t counter;
+    uint64_t frame;
+    // Records dropped between the previous record and this one
+    uint32_t droppedBefore;
+    uint16_t valueType;  // TraceSink::ValueType
+    uint16_t valueSize;
+    uint32_t width;
+    uint32_t height;
+    char name[24];  // 0 terminated, longer names are cut
+  };
+
+  struct FlightRecorderData;
+
+  // Keeps the face filter traces in memory and writes them out on a thread of its own, so tracing
+  // can stay on while the driver runs at full frame rate. Write() only copies the snapshot into a
+  // ring allocated up front; when the file cannot keep up and the ring is full, snapshots are
+  // dropped and counted instead of stalling the filter. Write() must be called from one thread.
+  class FlightRecorder : public TraceSink
+  {
+  public:
+    FlightRecorder(const std::string& filePath, uint32_t capacityBytes = 64 << 20);
+    // Writes out what is left in the ring
+    ~FlightRecorder();
+
+    void Write(const char* name, uint64_t frame, uint32_t counter, ValueType type, const void* data, uint32_t width, uint32_t height);
+
+    // Snapshots that did not fit into the ring, and those that did
+    uint64_t Dropped() const;
+    uint64_t Recorded() const;
+
+    // Reading back a file, throwing on a file that is not a recording. ReadRecord() returns false
+    // at the end of the file.
+    static void ReadFileHeader(std::istream& is);
+    static bool ReadRecord(std::istream& is, FlightRecordHeader& header, std::vector<char>& values);
+
+  private:
+    FlightRecorder(const FlightRecorder&);
+    FlightRecorder& operator=(const FlightRecorder&);
+
+    boost::shared_ptr<FlightRecorderData> _data;
+  };
+}
+
+#endif
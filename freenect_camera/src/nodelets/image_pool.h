@@ -0,0 +1,78 @@
+#ifndef FREENECT_CAMERA_IMAGE_POOL_H
+#define FREENECT_CAMERA_IMAGE_POOL_H
+
+#include <sensor_msgs/Image.h>
+#include <boost/make_shared.hpp>
+#include <freenect_camera/frame_ring.hpp>
+
+namespace freenect_camera
+{
+  /**
+   * \brief FrameAllocator backed by the data vectors of sensor_msgs::Image messages.
+   *
+   * libfreenect writes each frame straight into a message, which the driver then
+   * publishes as is. A message is recycled once nothing but the pool refers to it
+   * any more, so in steady state frames are neither copied nor zero-filled.
+   * allocate() is only called from the libfreenect thread.
+   */
+  class ImageMessagePool : public FrameAllocator
+  {
+    public:
+      explicit ImageMessagePool(size_t max_size = 16) : max_size_(max_size) {}
+
+      virtual boost::shared_ptr<void> allocate(size_t bytes, boost::shared_array<unsigned char>& data)
+      {
+        for (size_t i = 0; i < entries_.size(); ++i)
+        {
+          Entry& entry = entries_[i];
+          if (!entry.isFree())
+            continue;
+          if (entry.message->data.size() != bytes)
+            entry = Entry(bytes); // Left over from a previous mode
+          data = entry.data;
+          return entry.message;
+        }
+
+        Entry entry(bytes);
+        if (entries_.size() < max_size_)
+          entries_.push_back(entry);
+        data = entry.data;
+        return entry.message;
+      }
+
+    private:
+      /** Keeps the message alive for as long as its data is in use */
+      struct MessageOwner
+      {
+        explicit MessageOwner(const sensor_msgs::ImagePtr& message) : message(message) {}
+        void operator()(unsigned char*) {}
+        sensor_msgs::ImagePtr message;
+      };
+
+      struct Entry
+      {
+        Entry() {}
+
+        explicit Entry(size_t bytes)
+          : message(boost::make_shared<sensor_msgs::Image>())
+        {
+          message->data.resize(bytes);
+          data = boost::shared_array<unsigned char>(&message->data[0], MessageOwner(message));
+        }
+
+        /** Only the pool and the MessageOwner of data still reference the message */
+        bool isFree() const
+        {
+          return data.use_count() == 1 && message.use_count() == 2;
+        }
+
+        sensor_msgs::ImagePtr message;
+        boost::shared_array<unsigned char> data;
+      };
+
+      size_t max_size_;
+      std::vector<Entry> entries_;
+  };
+}
+
+#endif
@@ -0,0 +1,178 @@
+#include "point_cloud.h"
+
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define POINT_CLOUD_SSE2
+#endif
+
+namespace freenect_camera
+{
+  namespace
+  {
+    const float METERS_PER_MILLIMETER = 0.001f;
+
+    /** PCL's rgb field, 0x00RRGGBB in the bits of a float */
+    inline uint32_t packColor(uint32_t r, uint32_t g, uint32_t b)
+    {
+      return (r << 16) | (g << 8) | b;
+    }
+
+    /**
+     * Bilinear color of pixel u of a GRBG Bayer image, from its neighbours in the rows above
+     * and below and the columns left and right. Red rows are G R G R and blue rows B G B G;
+     * "own" is the color of the row and "other" the color of the rows around it.
+     */
+    inline uint32_t debayerPixel(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                                 uint32_t u, uint32_t left, uint32_t right, bool green, bool red_row)
+    {
+      uint32_t own, center, other;
+      if (green)
+      {
+        own = (row[left] + row[right] + 1) >> 1;
+        center = row[u];
+        other = (above[u] + below[u] + 1) >> 1;
+      }
+      else
+      {
+        own = row[u];
+        center = (row[left] + row[right] + above[u] + below[u] + 2) >> 2;
+        other = (above[left] + above[right] + below[left] + below[right] + 2) >> 2;
+      }
+      return red_row ? packColor(own, center, other) : packColor(other, center, own);
+    }
+
+    /** Colors of one row, with the columns past the borders mirrored, which keeps the pattern */
+    void debayerRow(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                    uint32_t width, bool red_row, uint32_t* colors)
+    {
+      // Red rows start with green, blue rows with blue
+      colors[0] = debayerPixel(above, row, below, 0, 1, 1, red_row, red_row);
+      uint32_t u = 1;
+      for (; u + 2 < width; u += 2)
+      {
+        colors[u] = debayerPixel(above, row, below, u, u - 1, u + 1, !red_row, red_row);
+        colors[u + 1] = debayerPixel(above, row, below, u + 1, u, u + 2, red_row, red_row);
+      }
+      for (; u < width; ++u)
+      {
+        const uint32_t right = u + 1 < width ? u + 1 : u - 1;
+        colors[u] = debayerPixel(above, row, below, u, u - 1, right, ((u & 1) == 0) == red_row, red_row);
+      }
+    }
+  }
+
+  DepthRayTable::DepthRayTable()
+    : width_(0), height_(0), fx_(0), fy_(0), cx_(0), cy_(0)
+  {
+  }
+
+  bool DepthRayTable::update(uint32_t width, uint32_t height, double fx, double fy, double cx, double cy)
+  {
+    if (width == width_ && height == height_ && fx == fx_ && fy == fy_ && cx == cx_ && cy == cy_)
+      return false;
+
+    width_ = width;
+    height_ = height;
+    fx_ = fx;
+    fy_ = fy;
+    cx_ = cx;
+    cy_ = cy;
+    column_rays_.resize(width);
+    for (uint32_t u = 0; u < width; ++u)
+      column_rays_[u] = static_cast<float>((u - cx) / fx * METERS_PER_MILLIMETER);
+    row_rays_.resize(height);
+    for (uint32_t v = 0; v < height; ++v)
+      row_rays_[v] = static_cast<float>((v - cy) / fy * METERS_PER_MILLIMETER);
+    return true;
+  }
+
+  void DepthRayTable::project(const uint16_t* depth, unsigned char* points) const
+  {
+    for (uint32_t v = 0; v < height_; ++v)
+    {
+      projectRow(depth + static_cast<size_t>(v) * width_, row_rays_[v], NULL,
+                 reinterpret_cast<float*>(points + static_cast<size_t>(v) * width_ * POINT_STEP));
+    }
+  }
+
+  void DepthRayTable::projectBayer(const uint16_t* depth, const uint8_t* bayer, unsigned char* points)
+  {
+    row_colors_.resize(width_);
+    for (uint32_t v = 0; v < height_; ++v)
+    {
+      // Mirrored like the columns, row -1 is row 1
+      const uint8_t* row = bayer + static_cast<size_t>(v) * width_;
+      const uint8_t* above = v > 0 ? row - width_ : row + width_;
+      const uint8_t* below = v + 1 < height_ ? row + width_ : row - width_;
+      debayerRow(above, row, below, width_, (v & 1) == 0, &row_colors_[0]);
+      projectRow(depth + static_cast<size_t>(v) * width_, row_rays_[v], &row_colors_[0],
+                 reinterpret_cast<float*>(points + static_cast<size_t>(v) * width_ * POINT_STEP));
+    }
+  }
+
+  void DepthRayTable::projectRgb(const uint16_t* depth, const uint8_t* rgb, unsigned char* points)
+  {
+    row_colors_.resize(width_);
+    for (uint32_t v = 0; v < height_; ++v)
+    {
+      const uint8_t* row = rgb + static_cast<size_t>(v) * width_ * 3;
+      for (uint32_t u = 0; u < width_; ++u)
+        row_colors_[u] = packColor(row[3 * u], row[3 * u + 1], row[3 * u + 2]);
+      projectRow(depth + static_cast<size_t>(v) * width_, row_rays_[v], &row_colors_[0],
+                 reinterpret_cast<float*>(points + static_cast<size_t>(v) * width_ * POINT_STEP));
+    }
+  }
+
+  void DepthRayTable::projectRow(const uint16_t* depth, float row_ray, const uint32_t* colors,
+                                 float* points) const
+  {
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    uint32_t u = 0;
+#if defined(POINT_CLOUD_SSE2)
+    // Four pixels at a time: three multiplies, then a transpose into x y z and padding or color
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 nans = _mm_set1_ps(nan);
+    const __m128 y_ray = _mm_set1_ps(row_ray);
+    const __m128 z_ray = _mm_set1_ps(METERS_PER_MILLIMETER);
+    for (; u + 4 <= width_; u += 4)
+    {
+      const __m128i raw = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(depth + u));
+      const __m128 d = _mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, zero));
+      const __m128 invalid = _mm_and_ps(_mm_cmpeq_ps(d, _mm_setzero_ps()), nans);
+
+      __m128 x = _mm_or_ps(_mm_mul_ps(d, _mm_loadu_ps(&column_rays_[u])), invalid);
+      __m128 y = _mm_or_ps(_mm_mul_ps(d, y_ray), invalid);
+      __m128 z = _mm_or_ps(_mm_mul_ps(d, z_ray), invalid);
+      __m128 padding = colors != NULL ?
+        _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(colors + u))) : _mm_setzero_ps();
+      _MM_TRANSPOSE4_PS(x, y, z, padding);
+      _mm_storeu_ps(points + 4 * u, x);
+      _mm_storeu_ps(points + 4 * u + 4, y);
+      _mm_storeu_ps(points + 4 * u + 8, z);
+      _mm_storeu_ps(points + 4 * u + 12, padding);
+    }
+#endif
+    for (; u < width_; ++u)
+    {
+      float* point = points + 4 * u;
+      if (depth[u] == 0)
+      {
+        point[0] = point[1] = point[2] = nan;
+      }
+      else
+      {
+        const float d = depth[u];
+        point[0] = d * column_rays_[u];
+        point[1] = d * row_ray;
+        point[2] = d * METERS_PER_MILLIMETER;
+      }
+      if (colors != NULL)
+        std::memcpy(&point[3], &colors[u], sizeof(float));
+      else
+        point[3] = 0;
+    }
+  }
+}
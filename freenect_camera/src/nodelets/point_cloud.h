@@ -0,0 +1,66 @@
+#ifndef FREENECT_CAMERA_POINT_CLOUD_H
+#define FREENECT_CAMERA_POINT_CLOUD_H
+
+#include <vector>
+#include <boost/cstdint.hpp>
+
+namespace freenect_camera
+{
+  /**
+   * \brief Projects depth images in millimeters to organized XYZ points in meters, with rays
+   * precomputed for one image size and set of pinhole intrinsics.
+   *
+   * A pixel's ray is scaled so that its z is one millimeter in meters, so each coordinate of
+   * a point is the depth times one table entry. Without distortion the x of a ray only
+   * depends on the column and the y only on the row, so the table holds one entry per
+   * column and one per row rather than one per pixel, and stays in cache.
+   */
+  class DepthRayTable
+  {
+    public:
+      /** Bytes per point written by project(): x, y and z as floats and 4 bytes of padding */
+      static const uint32_t POINT_STEP = 16;
+
+      DepthRayTable();
+
+      /**
+       * Rebuilds the rays unless they already are for these intrinsics, focal lengths and
+       * principal point in pixels. Returns whether they were rebuilt.
+       */
+      bool update(uint32_t width, uint32_t height, double fx, double fy, double cx, double cy);
+
+      uint32_t width() const { return width_; }
+      uint32_t height() const { return height_; }
+
+      /**
+       * Writes width() * height() points of POINT_STEP bytes into points, row by row. Pixels
+       * without depth become NaN points, as in depth_image_proc.
+       */
+      void project(const uint16_t* depth, unsigned char* points) const;
+
+      /**
+       * Like project(), with the color of each pixel of a pixel-aligned GRBG Bayer image in
+       * place of the padding, packed as PCL's rgb field. The image is debayered bilinearly,
+       * one row at a time, and needs at least 2 x 2 pixels.
+       */
+      void projectBayer(const uint16_t* depth, const uint8_t* bayer, unsigned char* points);
+
+      /** Like projectBayer(), for an RGB8 image */
+      void projectRgb(const uint16_t* depth, const uint8_t* rgb, unsigned char* points);
+
+    private:
+      uint32_t width_;
+      uint32_t height_;
+      double fx_, fy_, cx_, cy_;
+      /** x of the ray through each column, y of the ray through each row, per millimeter */
+      std::vector<float> column_rays_;
+      std::vector<float> row_rays_;
+      /** Packed colors of the row being projected */
+      std::vector<uint32_t> row_colors_;
+
+      /** Writes one row of points, with colors in the padding unless they are NULL */
+      void projectRow(const uint16_t* depth, float row_ray, const uint32_t* colors, float* points) const;
+  };
+}
+
+#endif
@@ -0,0 +1,299 @@
+#include "replay_backend.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <time.h>
+#include <ros/ros.h>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace freenect_camera {
+
+  namespace {
+
+    using boost::posix_time::ptime;
+    using boost::posix_time::time_duration;
+
+    const char REPLAY_SERIAL[] = "replay";
+
+    /** Pace of frames without usable timestamps, the Kinect's 30 Hz */
+    const time_duration DEFAULT_FRAME_INTERVAL = boost::posix_time::microseconds(33333);
+
+    struct ReplayStream {
+      ReplayStream() : next(0), running(false), buffer(NULL), warned(false) {
+        std::memset(&mode, 0, sizeof(mode));
+      }
+
+      std::vector<boost::shared_ptr<MappedFrame> > frames;
+      /** Index of the next frame, frames.size() once played to the end */
+      size_t next;
+      bool running;
+      void* buffer;
+      freenect_frame_mode mode;
+      ptime started;
+      ptime due;
+      /** Warned about frames not matching the mode */
+      bool warned;
+    };
+
+    /**
+     * CLOCK_MONOTONIC as a ptime, so setting the system time does not stall
+     * replay or make it catch up in a burst
+     */
+    ptime now() {
+      static const ptime origin(boost::gregorian::date(1970, 1, 1));
+      timespec time;
+      clock_gettime(CLOCK_MONOTONIC, &time);
+      return origin + boost::posix_time::microseconds(
+          static_cast<boost::int64_t>(time.tv_sec) * 1000000 + time.tv_nsec / 1000);
+    }
+
+    /**
+     * The pattern is a printf format for one int, the frame number, so it may
+     * have at most one integer conversion, with flags, width and precision
+     * but no length modifier, and %% otherwise
+     */
+    void checkPattern(const std::string& pattern) {
+      int conversions = 0;
+      for (size_t i = 0; i < pattern.size(); ++i) {
+        if (pattern[i] != '%')
+          continue;
+        if (++i < pattern.size() && pattern[i] == '%')
+          continue;
+        while (i < pattern.size() && std::strchr("-+ #0", pattern[i]) != NULL)
+          ++i;
+        while (i < pattern.size() && std::isdigit(static_cast<unsigned char>(pattern[i])))
+          ++i;
+        if (i < pattern.size() && pattern[i] == '.') {
+          ++i;
+          while (i < pattern.size() && std::isdigit(static_cast<unsigned char>(pattern[i])))
+            ++i;
+        }
+        if (i == pattern.size() || std::strchr("diouxX", pattern[i]) == NULL || ++conversions > 1)
+          throw std::runtime_error("[ERROR] Cannot replay " + pattern +
+              ": frame patterns take one integer conversion such as %05d");
+      }
+    }
+
+    void loadFrames(const std::string& pattern, ReplayStream& stream) {
+      checkPattern(pattern);
+      std::vector<char> path(pattern.size() + 32);
+      std::string previous;
+      for (int i = 0; ; ++i) {
+        if (static_cast<size_t>(snprintf(&path[0], path.size(), pattern.c_str(), i)) >= path.size())
+          throw std::runtime_error("[ERROR] Cannot replay " + pattern + ": the frame paths are too long");
+        // A pattern without a number names one file
+        if (std::string(&path[0]) == previous || !std::ifstream(&path[0]))
+          break;
+        previous = &path[0];
+        try {
+          stream.frames.push_back(boost::shared_ptr<MappedFrame>(new MappedFrame(previous)));
+        } catch (std::runtime_error* e) {
+          const std::string message = e->what();
+          delete e;
+          throw std::runtime_error("[ERROR] Cannot replay: " + message);
+        }
+      }
+    }
+
+    time_duration frameInterval(const MappedFrame& frame, const MappedFrame& following) {
+      if (frame.Timestamp() == 0 || following.Timestamp() <= frame.Timestamp() ||
+          following.Timestamp() - frame.Timestamp() >= 1000000000ULL)
+        return DEFAULT_FRAME_INTERVAL;
+      return boost::posix_time::microseconds((following.Timestamp() - frame.Timestamp()) / 1000);
+    }
+
+  }
+
+  /**
+   * \brief The camera of a ReplayDriverBackend. Everything but open() runs on
+   * the driver's event thread.
+   */
+  class ReplayDeviceBackend : public DeviceBackend, private boost::noncopyable {
+
+    public:
+
+      ReplayDeviceBackend(const std::string& depth_pattern, const std::string& video_pattern)
+        : listener_(NULL) {
+        loadFrames(depth_pattern, depth_);
+        if (depth_.frames.empty())
+          throw std::runtime_error("[ERROR] No depth frames to replay at " + depth_pattern);
+        if (!video_pattern.empty())
+          loadFrames(video_pattern, video_);
+
+        // A typical Kinect, for the focal lengths and the baseline
+        std::memset(&registration_, 0, sizeof(registration_));
+        registration_.zero_plane_info.dcmos_emitter_dist = 7.5f;
+        registration_.zero_plane_info.dcmos_rcmos_dist = 2.3f;
+        registration_.zero_plane_info.reference_distance = 120.0f;
+        registration_.zero_plane_info.reference_pixel_size = 0.1042f;
+      }
+
+      void setListener(Listener* listener) {
+        listener_ = listener;
+      }
+
+      const freenect_registration& registration() const {
+        return registration_;
+      }
+
+      void setVideoMode(const freenect_frame_mode& mode) {
+        video_.mode = mode;
+        video_.warned = false;
+      }
+
+      void setVideoBuffer(void* buffer) {
+        video_.buffer = buffer;
+      }
+
+      void startVideo() {
+        start(video_);
+      }
+
+      void stopVideo() {
+        video_.running = false;
+      }
+
+      void setDepthMode(const freenect_frame_mode& mode) {
+        depth_.mode = mode;
+        depth_.warned = false;
+      }
+
+      void setDepthBuffer(void* buffer) {
+        depth_.buffer = buffer;
+      }
+
+      void startDepth() {
+        start(depth_);
+      }
+
+      void stopDepth() {
+        depth_.running = false;
+      }
+
+      void close() {
+        depth_.running = video_.running = false;
+        listener_ = NULL;
+      }
+
+      /** \brief Plays the frames that are due, returns whether there were any */
+      bool play(const ptime& time, bool real_time, bool loop) {
+        const bool depth = play(depth_, true, time, real_time, loop);
+        const bool video = play(video_, false, time, real_time, loop);
+        return depth || video;
+      }
+
+      /** \brief Moves wake_up forward to when the next frame is due */
+      void nextDue(ptime& wake_up) const {
+        if (depth_.running && depth_.next < depth_.frames.size() && depth_.due < wake_up)
+          wake_up = depth_.due;
+        if (video_.running && video_.next < video_.frames.size() && video_.due < wake_up)
+          wake_up = video_.due;
+      }
+
+    private:
+
+      static void start(ReplayStream& stream) {
+        if (stream.running)
+          return;
+        stream.running = true;
+        stream.started = stream.due = now();
+      }
+
+      static bool playable(const ReplayStream& stream, bool depth, const MappedFrame& frame) {
+        if (static_cast<size_t>(stream.mode.bytes) != frame.PixelBytes())
+          return false;
+        if (depth)
+          return frame.PixelType() == FrameFileHeader::PixelDepthUInt16 &&
+            (stream.mode.depth_format == FREENECT_DEPTH_MM ||
+             stream.mode.depth_format == FREENECT_DEPTH_REGISTERED);
+        return frame.PixelType() == FrameFileHeader::PixelBayerGrbgUInt8 &&
+          stream.mode.video_format == FREENECT_VIDEO_BAYER;
+      }
+
+      bool play(ReplayStream& stream, bool depth, const ptime& time, bool real_time, bool loop) {
+        if (!stream.running || stream.buffer == NULL || listener_ == NULL ||
+            stream.next >= stream.frames.size())
+          return false;
+        if (real_time && time < stream.due)
+          return false;
+
+        const MappedFrame& frame = *stream.frames[stream.next];
+        if (!playable(stream, depth, frame)) {
+          if (!stream.warned)
+            ROS_WARN("Recorded %s frames do not fit the current %s mode, none are replayed",
+                depth ? "depth" : "video", depth ? "depth" : "video");
+          stream.warned = true;
+          return false;
+        }
+        std::memcpy(stream.buffer, frame.Pixels(), frame.PixelBytes());
+
+        // Device timestamps count microseconds: the recorded ones, or since the
+        // stream started for recordings without
+        const uint32_t timestamp = static_cast<uint32_t>(frame.Timestamp() != 0 ?
+            frame.Timestamp() / 1000 : (time - stream.started).total_microseconds());
+
+        size_t following = stream.next + 1;
+        if (following == stream.frames.size() && loop)
+          following = 0;
+        stream.due += following == 0 || following == stream.frames.size() ?
+          DEFAULT_FRAME_INTERVAL : frameInterval(frame, *stream.frames[following]);
+        // After a stall, go on at the recorded pace instead of catching up in a burst
+        if (stream.due < time)
+          stream.due = time;
+        stream.next = following;
+
+        // Sets the buffer of the next frame
+        if (depth)
+          listener_->depthFrameReady(stream.buffer, timestamp);
+        else
+          listener_->videoFrameReady(stream.buffer, timestamp);
+        return true;
+      }
+
+      ReplayStream depth_;
+      ReplayStream video_;
+      freenect_registration registration_;
+      Listener* listener_;
+  };
+
+  ReplayDriverBackend::ReplayDriverBackend(const std::string& depth_pattern,
+      const std::string& video_pattern, bool real_time, bool loop)
+    : real_time_(real_time), loop_(loop),
+      device_(new ReplayDeviceBackend(depth_pattern, video_pattern)) {
+  }
+
+  ReplayDriverBackend::~ReplayDriverBackend() {
+  }
+
+  std::vector<std::string> ReplayDriverBackend::listSerials() {
+    return std::vector<std::string>(1, REPLAY_SERIAL);
+  }
+
+  DeviceBackendPtr ReplayDriverBackend::openDevice(const std::string& serial) {
+    if (serial != REPLAY_SERIAL)
+      throw std::runtime_error("[ERROR] Unable to open specified kinect");
+    return device_;
+  }
+
+  void ReplayDriverBackend::processEvents(int timeout_ms) {
+    const ptime time = now();
+    if (device_->play(time, real_time_, loop_))
+      return;
+
+    ptime wake_up = time + boost::posix_time::milliseconds(timeout_ms);
+    if (real_time_)
+      device_->nextDue(wake_up);
+    if (wake_up > time)
+      boost::this_thread::sleep(wake_up - time);
+  }
+
+  void ReplayDriverBackend::shutdown() {
+    device_->close();
+  }
+
+}
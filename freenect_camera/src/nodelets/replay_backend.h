@@ -0,0 +1,51 @@
+#ifndef FREENECT_CAMERA_REPLAY_BACKEND_H
+#define FREENECT_CAMERA_REPLAY_BACKEND_H
+
+#include <freenect_camera/device_backend.hpp>
+#include "face_filter.h"
+
+namespace freenect_camera {
+
+  class ReplayDeviceBackend;
+
+  /**
+   * \brief Plays recorded frame files (see FrameFileHeader) through the driver
+   * as one camera with the serial number "replay", so the whole publishing
+   * chain runs without a Kinect.
+   *
+   * Depth files hold millimeters and are played while the depth stream runs
+   * in FREENECT_DEPTH_MM or FREENECT_DEPTH_REGISTERED, unchanged. Video files
+   * hold Bayer frames and are played while the RGB stream runs; the IR stream
+   * gets no frames. Only frames of the size of the current mode are played.
+   */
+  class ReplayDriverBackend : public DriverBackend {
+
+    public:
+
+      /**
+       * The patterns are printf patterns with one integer, like
+       * "run1/depth-%05d.frame", and the frames are numbered from 0 up to the
+       * first missing file. An empty video_pattern replays depth only.
+       * Frames are played at the pace they were recorded at, by their
+       * timestamps or at 30 Hz without, or if real_time is false as fast as
+       * the driver takes them. With loop the recording starts over at the end.
+       */
+      ReplayDriverBackend(const std::string& depth_pattern,
+          const std::string& video_pattern, bool real_time, bool loop);
+      ~ReplayDriverBackend();
+
+      std::vector<std::string> listSerials();
+      DeviceBackendPtr openDevice(const std::string& serial);
+      void processEvents(int timeout_ms);
+      void shutdown();
+
+    private:
+
+      bool real_time_;
+      bool loop_;
+      boost::shared_ptr<ReplayDeviceBackend> device_;
+  };
+
+}
+
+#endif
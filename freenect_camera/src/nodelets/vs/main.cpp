@@ -4,6 +4,10 @@
 #include "unittest.h"
 #include "..\face_filter.h"
 #include "..\face_filter.hpp"
+#include "..\face_filter_fixed.hpp"
+#include "..\flight_recorder.h"
+#include <fstream>
+#include <chrono>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 using namespace freenect_camera;
@@ -34,14 +38,23 @@ namespace UnitTest1
       ::CreateDirectoryA(_pathToTestOutDir.c_str(), nullptr);
     }
 
+    // The fixtures are frame files made by csv_to_frame, so loading them is just a copy
+    static void LoadFrame(const std::string& filePath, uint32_t expectedWidth, uint32_t expectedHeight, uint16_t* data)
+    {
+      MappedFrame frame(filePath);
+      Assert::AreEqual(expectedWidth, frame.Width());
+      Assert::AreEqual(expectedHeight, frame.Height());
+      std::copy(frame.Data(), frame.Data() + expectedWidth * expectedHeight, data);
+    }
+
     TEST_METHOD(Transform1)
     {
-      const std::string testFilePath = _pathToDataDir + "kinect-2015-09-02--21-32-01--00000.csv";
+      const std::string testFilePath = _pathToDataDir + "kinect-2015-09-02--21-32-01--00000.frame";
       const std::string testFilePathBase = _pathToTestOutDir + "kinect-2015-09-02--21-32-01--00000-result";
       const uint32_t width = 640;
       const uint32_t heigth = 480;
       std::unique_ptr<uint16_t> data(new uint16_t[width * heigth]);
-      FaceFilter::LoadDataFromCsv(testFilePath, width, heigth, data.get());
+      LoadFrame(testFilePath, width, heigth, data.get());
       FaceFilterHistogramTransform ff(30U, 20U, 4000U, true, testFilePathBase);
       ff.Transform(width, heigth, data.get());
 
@@ -49,6 +62,204 @@ namespace UnitTest1
       FaceFilter::SaveDataAsCsv(width, heigth, data.get(), outtTestFilePath);
     }
 
+    TEST_METHOD(TransformReuse)
+    {
+      const std::string testFilePath = _pathToDataDir + "kinect-2015-09-02--21-32-01--00000.frame";
+      const uint32_t width = 640;
+      const uint32_t heigth = 480;
+      std::vector<uint16_t> input(width * heigth);
+      LoadFrame(testFilePath, width, heigth, input.data());
+
+      // A transform that has already seen other frames must not carry anything over.
+      FaceFilterHistogramTransform reused;
+      std::vector<uint16_t> other(width * heigth, 1500);
+      reused.Transform(width, heigth, other.data());
+      std::vector<uint16_t> actual(input);
+      reused.Transform(width, heigth, actual.data());
+
+      FaceFilterHistogramTransform fresh;
+      std::vector<uint16_t> expected(input);
+      fresh.Transform(width, heigth, expected.data());
+
+      for (size_t i = 0; i < expected.size(); i++)
+      {
+        Assert::AreEqual(expected[i], actual[i]);
+      }
+    }
+
+    // FNV-1a over the bytes of a frame, so expected outputs fit into the test
+    static uint64_t HashFrame(const std::vector<uint16_t>& data)
+    {
+      uint64_t hash = 14695981039346656037ull;
+      for (size_t i = 0; i < data.size(); i++)
+      {
+        hash = (hash ^ (data[i] & 0xFF)) * 1099511628211ull;
+        hash = (hash ^ (data[i] >> 8)) * 1099511628211ull;
+      }
+      return hash;
+    }
+
+    // Outputs captured from the filter before its histogram was laid out segment-major,
+    // including a crop whose size is not a multiple of the segments and an odd layer count.
+    TEST_METHOD(TransformMatchesReference)
+    {
+      const std::string testFilePath = _pathToDataDir + "kinect-2015-09-02--21-32-01--00000.frame";
+      const uint32_t width = 640;
+      const uint32_t heigth = 480;
+      std::vector<uint16_t> input(width * heigth);
+      LoadFrame(testFilePath, width, heigth, input.data());
+
+      std::vector<uint16_t> actual(input);
+      FaceFilterHistogramTransform defaults;
+      defaults.Transform(width, heigth, actual.data());
+      Assert::AreEqual(0x208ef5c13154cfc1ull, HashFrame(actual));
+
+      actual = input;
+      FaceFilterHistogramTransform odd(17U, 13U, 4500U);
+      odd.Transform(width, heigth, actual.data());
+      Assert::AreEqual(0x4f2d9f141eeda325ull, HashFrame(actual));
+
+      const uint32_t cropWidth = 333;
+      const uint32_t cropHeigth = 247;
+      std::vector<uint16_t> crop(cropWidth * cropHeigth);
+      for (uint32_t y = 0; y < cropHeigth; y++)
+      {
+        std::copy(input.begin() + (y + 120) * width + 150, input.begin() + (y + 120) * width + 150 + cropWidth, crop.begin() + y * cropWidth);
+      }
+      Assert::AreEqual(0x4d1b5b66db0a813eull, HashFrame(crop));
+      FaceFilterHistogramTransform cropped(17U, 13U, 4500U);
+      cropped.Transform(cropWidth, cropHeigth, crop.data());
+      Assert::AreEqual(0xbe9f4d394ca9da7dull, HashFrame(crop));
+    }
+
+    TEST_METHOD(ClampDepthMatchesScalar)
+    {
+      const std::string testFilePath = _pathToDataDir + "kinect-2015-09-02--21-32-01--00000.frame";
+      const uint32_t width = 640;
+      const uint32_t heigth = 480;
+      std::vector<uint16_t> input(width * heigth);
+      LoadFrame(testFilePath, width, heigth, input.data());
+
+      // Row spans of 32 pixels with limits around the depths in the frame, including the extremes.
+      const uint16_t limits[] = { 0, 700, 1400, 2100, 2800, 4000, 65535 };
+      std::vector<uint16_t> maxAllowed(input.size());
+      for (size_t i = 0; i < maxAllowed.size(); i++)
+      {
+        maxAllowed[i] = limits[(i / 32) % _countof(limits)];
+      }
+
+      // Unaligned start and a count that leaves a tail for the scalar loop.
+      const uint32_t count = width * heigth - 11;
+      std::vector<uint16_t> expected(input);
+      FaceFilter::ClampDepthScalar(maxAllowed.data() + 1, expected.data() + 1, count);
+      std::vector<uint16_t> actual(input);
+      FaceFilter::ClampDepth(maxAllowed.data() + 1, actual.data() + 1, count);
+
+      for (size_t i = 0; i < expected.size(); i++)
+      {
+        Assert::AreEqual(expected[i], actual[i]);
+      }
+    }
+
+    TEST_METHOD(MaskEnginesAgree)
+    {
+      const std::string testFilePath = _pathToDataDir + "kinect-2015-09-02--21-32-01--00000.frame";
+      const std::string testFilePathBase = _pathToTestOutDir + "mask-engines";
+      const uint32_t width = 640;
+      const uint32_t heigth = 480;
+      std::vector<uint16_t> input(width * heigth);
+      LoadFrame(testFilePath, width, heigth, input.data());
+
+      // Tracing needs the per-layer scores, so it always takes the integral image path.
+      FaceFilterHistogramTransform integral(30U, 20U, 4000U, true, testFilePathBase);
+      std::vector<uint16_t> expected(input);
+      integral.Transform(width, heigth, expected.data());
+
+      FaceFilterHistogramTransform bitmaps(30U, 20U, 4000U);
+      std::vector<uint16_t> actual(input);
+      bitmaps.Transform(width, heigth, actual.data());
+
+      for (size_t i = 0; i < expected.size(); i++)
+      {
+        Assert::AreEqual(expected[i], actual[i]);
+      }
+    }
+
+    TEST_METHOD(FixedMatchesRuntime)
+    {
+      const std::string testFilePath = _pathToDataDir + "kinect-2015-09-02--21-32-01--00000.frame";
+      const uint32_t width = 640;
+      const uint32_t heigth = 480;
+      std::vector<uint16_t> input(width * heigth);
+      LoadFrame(testFilePath, width, heigth, input.data());
+
+      FaceFilterHistogramTransform runtime(16U, 32U, 5000U);
+      std::vector<uint16_t> expected(input);
+      runtime.Transform(width, heigth, expected.data());
+
+      std::unique_ptr<FixedFaceFilterHistogramTransform<16, 32, 5, 1>> fixed(new FixedFaceFilterHistogramTransform<16, 32, 5, 1>(5000U));
+      std::vector<uint16_t> actual(input);
+      fixed->Transform(width, heigth, actual.data());
+
+      for (size_t i = 0; i < expected.size(); i++)
+      {
+        Assert::AreEqual(expected[i], actual[i]);
+      }
+    }
+
+    // Replays a sequence derived from the bundled frame, with sensor noise and an object moving
+    // across, through an incremental and a full transform. Logs the time per frame of both.
+    TEST_METHOD(IncrementalMatchesFull)
+    {
+      const std::string testFilePath = _pathToDataDir + "kinect-2015-09-02--21-32-01--00000.frame";
+      const uint32_t width = 640;
+      const uint32_t heigth = 480;
+      const int frames = 100;
+      std::vector<uint16_t> input(width * heigth);
+      LoadFrame(testFilePath, width, heigth, input.data());
+
+      FaceFilterHistogramTransform full;
+      FaceFilterHistogramTransform incremental;
+      incremental.SetIncremental(true, 30);
+
+      uint32_t random = 1;
+      double fullMs = 0;
+      double incrementalMs = 0;
+      for (int n = 0; n < frames; n++)
+      {
+        std::vector<uint16_t> expected(input);
+        for (size_t k = 0; k < expected.size() / 50; k++)
+        {
+          random = random * 1103515245u + 12345u;
+          const size_t i = (random >> 8) % expected.size();
+          if (expected[i] != 0)
+            expected[i] += (random >> 4) % 9 - 4;
+        }
+        const int cx = 100 + n * 4, cy = 240, r = 40;
+        for (int y = cy - r; y <= cy + r; y++)
+          for (int x = cx - r; x <= cx + r; x++)
+            if (x >= 0 && x < (int)width && y >= 0 && y < (int)heigth && (x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r)
+              expected[y * width + x] = static_cast<uint16_t>(1200 + (x + y) % 30);
+        std::vector<uint16_t> actual(expected);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        full.Transform(width, heigth, expected.data());
+        fullMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        start = std::chrono::high_resolution_clock::now();
+        incremental.Transform(width, heigth, actual.data());
+        incrementalMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+          Assert::AreEqual(expected[i], actual[i]);
+        }
+      }
+
+      char message[128];
+      sprintf(message, "Transform: full %.3f ms, incremental %.3f ms per frame.\n", fullMs / frames, incrementalMs / frames);
+      Logger::WriteMessage(message);
+    }
+
     TEST_METHOD(SaveLoad)
     {
       const std::string testFilePath = _pathToTestOutDir + "save_load.csv";
@@ -69,5 +280,182 @@ namespace UnitTest1
         Assert::AreEqual(data.get()[i], dataActual.get()[i]);
       }
     }
+
+    // Plain rows are parsed a row at a time, the others value by value. Both give the same values.
+    TEST_METHOD(LoadCsvRowForms)
+    {
+      const std::string testFilePath = _pathToTestOutDir + "row_forms.csv";
+      {
+        std::ofstream ofs(testFilePath.c_str(), std::ofstream::binary);
+        ofs << "0,7,99,1234,65535\n" << "00012, 3,\t40 ,5,6\r\n" << "9999,10000,1,22,333";
+      }
+      const uint16_t expected[] = { 0, 7, 99, 1234, 65535, 12, 3, 40, 5, 6, 9999, 10000, 1, 22, 333 };
+      uint16_t actual[15];
+      FaceFilter::LoadDataFromCsv(testFilePath, 5, 3, actual);
+      for (auto i = 0; i < 15; i++)
+      {
+        Assert::AreEqual(expected[i], actual[i]);
+      }
+
+      char text[22 * 5];
+      const std::string row(text, FormatCsvRow(expected, 5, text));
+      Assert::AreEqual(std::string("0,7,99,1234,65535\n"), row);
+    }
+
+    // Saves and loads the bundled frame as CSV and logs the throughput of both.
+    TEST_METHOD(CsvThroughput)
+    {
+      const std::string csvFilePath = _pathToDataDir + "kinect-2015-09-02--21-32-01--00000.csv";
+      const std::string frameFilePath = _pathToDataDir + "kinect-2015-09-02--21-32-01--00000.frame";
+      const std::string testFilePath = _pathToTestOutDir + "csv_throughput.csv";
+      const uint32_t width = 640;
+      const uint32_t heigth = 480;
+      const int repetitions = 20;
+      std::vector<uint16_t> expected(width * heigth);
+      LoadFrame(frameFilePath, width, heigth, expected.data());
+
+      std::vector<uint16_t> actual(width * heigth);
+      FaceFilter::LoadDataFromCsv(csvFilePath, width, heigth, actual.data());
+      Assert::IsTrue(expected == actual);
+
+      auto start = std::chrono::high_resolution_clock::now();
+      for (int n = 0; n < repetitions; n++)
+      {
+        FaceFilter::SaveDataAsCsv(width, heigth, expected.data(), testFilePath);
+      }
+      const double saveMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / repetitions;
+
+      start = std::chrono::high_resolution_clock::now();
+      for (int n = 0; n < repetitions; n++)
+      {
+        FaceFilter::LoadDataFromCsv(testFilePath, width, heigth, actual.data());
+      }
+      const double loadMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / repetitions;
+      Assert::IsTrue(expected == actual);
+
+      std::ifstream file(testFilePath.c_str(), std::ifstream::binary | std::ifstream::ate);
+      const double megabytes = static_cast<double>(file.tellg()) / (1024 * 1024);
+      char message[160];
+      sprintf(message, "CSV: save %.2f ms (%.0f MB/s), load %.2f ms (%.0f MB/s) per frame.\n", saveMs, megabytes * 1000 / saveMs, loadMs, megabytes * 1000 / loadMs);
+      Logger::WriteMessage(message);
+    }
+
+    TEST_METHOD(SaveLoadFrame)
+    {
+      const std::string testFilePath = _pathToTestOutDir + "save_load.frame";
+      const uint32_t width = 640u;
+      const uint32_t heigth = 480u;
+      std::vector<uint16_t> data(width * heigth);
+      for (size_t i = 0; i < data.size(); i++)
+      {
+        data[i] = static_cast<uint16_t>(i % std::numeric_limits<uint16_t>::max());
+      }
+
+      FaceFilter::SaveDataAsFrame(width, heigth, data.data(), testFilePath, 1441229521000000000ULL);
+
+      MappedFrame frame(testFilePath);
+      Assert::AreEqual(width, frame.Width());
+      Assert::AreEqual(heigth, frame.Height());
+      Assert::IsTrue(frame.Timestamp() == 1441229521000000000ULL);
+      for (size_t i = 0; i < data.size(); i++)
+      {
+        Assert::AreEqual(data[i], frame.Data()[i]);
+      }
+    }
+
+    TEST_METHOD(SaveLoadBayerFrame)
+    {
+      const std::string testFilePath = _pathToTestOutDir + "save_load_bayer.frame";
+      const uint32_t width = 640u;
+      const uint32_t heigth = 480u;
+      std::vector<uint8_t> bayer(width * heigth);
+      for (size_t i = 0; i < bayer.size(); i++)
+      {
+        bayer[i] = static_cast<uint8_t>(i * 7);
+      }
+
+      FaceFilter::SaveDataAsFrame(width, heigth, bayer.data(), testFilePath);
+
+      MappedFrame frame(testFilePath);
+      Assert::IsTrue(frame.PixelType() == FrameFileHeader::PixelBayerGrbgUInt8);
+      Assert::IsTrue(frame.PixelBytes() == bayer.size());
+      Assert::IsTrue(std::memcmp(frame.Pixels(), bayer.data(), bayer.size()) == 0);
+    }
+
+    TEST_METHOD(FlightRecorderMatchesCsvTraces)
+    {
+      const uint32_t width = 640u;
+      const uint32_t heigth = 480u;
+      std::vector<uint16_t> data(width * heigth);
+      LoadFrame(_pathToDataDir + "kinect-2015-09-02--21-32-01--00000.frame", width, heigth, data.data());
+
+      const std::string recordingPath = _pathToTestOutDir + "trace.ftr";
+      const std::string csvBase = _pathToTestOutDir + "trace";
+      uint64_t recorded = 0;
+      {
+        std::vector<uint16_t> csvData = data;
+        FaceFilterHistogramTransform csvTracing(30, 20, 4000, true, csvBase);
+        csvTracing.Transform(width, heigth, csvData.data());
+
+        FlightRecorder recorder(recordingPath);
+        FaceFilterHistogramTransform recorderTracing(30, 20, 4000, &recorder);
+        recorderTracing.Transform(width, heigth, data.data());
+        Assert::IsTrue(recorder.Dropped() == 0);
+        recorded = recorder.Recorded();
+      }
+      Assert::IsTrue(recorded > 0);
+
+      // Every record holds what the CSV tracing wrote for the same snapshot
+      std::ifstream is(recordingPath, std::ifstream::binary);
+      FlightRecorder::ReadFileHeader(is);
+      FlightRecordHeader header;
+      std::vector<char> values;
+      uint64_t read = 0;
+      while (FlightRecorder::ReadRecord(is, header, values))
+      {
+        char csvPath[1024];
+        sprintf(csvPath, "%s_%02d_%s.csv", csvBase.c_str(), header.counter, header.name);
+        std::vector<char> expected(values.size());
+        switch (header.valueType)
+        {
+        case TraceSink::Int8:
+          FaceFilter::LoadDataFromCsv(csvPath, header.width, header.height, expected.data());
+          break;
+        case TraceSink::Int16:
+          FaceFilter::LoadDataFromCsv(csvPath, header.width, header.height, reinterpret_cast<int16_t*>(expected.data()));
+          break;
+        default:
+          FaceFilter::LoadDataFromCsv(csvPath, header.width, header.height, reinterpret_cast<uint16_t*>(expected.data()));
+          break;
+        }
+        Assert::IsTrue(expected == values);
+        read++;
+      }
+      Assert::IsTrue(read == recorded);
+    }
+
+    TEST_METHOD(FlightRecorderCountsDrops)
+    {
+      // The smallest ring cannot hold even one 640x480 snapshot
+      const std::string recordingPath = _pathToTestOutDir + "drops.ftr";
+      std::vector<uint16_t> snapshot(640 * 480);
+      {
+        FlightRecorder recorder(recordingPath, 4096);
+        recorder.Write("small", 0, 0, TraceSink::UInt16, snapshot.data(), 20, 30);
+        recorder.Write("large", 0, 1, TraceSink::UInt16, snapshot.data(), 640, 480);
+        recorder.Write("large", 0, 2, TraceSink::UInt16, snapshot.data(), 640, 480);
+        Assert::IsTrue(recorder.Dropped() == 2);
+        Assert::IsTrue(recorder.Recorded() == 1);
+      }
+
+      std::ifstream is(recordingPath, std::ifstream::binary);
+      FlightRecorder::ReadFileHeader(is);
+      FlightRecordHeader header;
+      std::vector<char> values;
+      Assert::IsTrue(FlightRecorder::ReadRecord(is, header, values));
+      Assert::AreEqual(std::string("small"), std::string(header.name));
+      Assert::IsTrue(header.droppedBefore == 0);
+      Assert::IsFalse(FlightRecorder::ReadRecord(is, header, values));
+    }
   };
-}
\ No newline at end of file
+}
@@ -0,0 +1,126 @@
+// Converts depth frames saved by FaceFilter::SaveDataAsCsv() into frame files
+// (see FrameFileHeader), which MappedFrame loads without any parsing.
+//
+//   csv_to_frame [--width 640] [--height 480] frame.csv...
+//
+// writes frame.frame next to every frame.csv.
+
+#include "../nodelets/face_filter.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+using namespace freenect_camera;
+
+namespace {
+
+// The values are read in order and line breaks count as separators, so files whose
+// rows are not exactly width values long (the vs/data fixture used to be shifted by
+// one value) still convert as long as the total is right.
+bool readCsvValues(const std::string& path, std::vector<uint16_t>& values)
+{
+  std::ifstream ifs(path.c_str(), std::ifstream::in | std::ifstream::binary);
+  if (!ifs)
+  {
+    fprintf(stderr, "Cannot open %s\n", path.c_str());
+    return false;
+  }
+  const std::string text((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+  values.clear();
+  uint32_t value = 0;
+  bool inValue = false;
+  for (size_t i = 0; i <= text.size(); ++i)
+  {
+    const char c = i < text.size() ? text[i] : '\n';
+    if (c >= '0' && c <= '9')
+    {
+      value = value * 10 + (c - '0');
+      inValue = true;
+      if (value > 65535)
+      {
+        fprintf(stderr, "%s: value out of range at byte %lu\n", path.c_str(), static_cast<unsigned long>(i));
+        return false;
+      }
+    }
+    else if (c == ',' || c == '\n' || c == '\r' || c == ' ')
+    {
+      if (inValue)
+        values.push_back(static_cast<uint16_t>(value));
+      value = 0;
+      inValue = false;
+    }
+    else
+    {
+      fprintf(stderr, "%s: unexpected character at byte %lu\n", path.c_str(), static_cast<unsigned long>(i));
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string framePath(const std::string& csvPath)
+{
+  const size_t dot = csvPath.find_last_of('.');
+  const size_t slash = csvPath.find_last_of("/\\");
+  const bool hasExtension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+  return (hasExtension ? csvPath.substr(0, dot) : csvPath) + ".frame";
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t width = 640;
+  uint32_t height = 480;
+  std::vector<std::string> inputs;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--width") == 0 && i + 1 < argc)
+      width = static_cast<uint32_t>(atoi(argv[++i]));
+    else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc)
+      height = static_cast<uint32_t>(atoi(argv[++i]));
+    else
+      inputs.push_back(argv[i]);
+  }
+  if (inputs.empty() || width == 0 || height == 0)
+  {
+    fprintf(stderr, "Usage: %s [--width 640] [--height 480] frame.csv...\n", argv[0]);
+    return 2;
+  }
+
+  int failures = 0;
+  std::vector<uint16_t> values;
+  for (size_t i = 0; i < inputs.size(); ++i)
+  {
+    if (!readCsvValues(inputs[i], values))
+    {
+      failures++;
+      continue;
+    }
+    if (values.size() != static_cast<size_t>(width) * height)
+    {
+      fprintf(stderr, "%s: %lu values, expected %ux%u\n", inputs[i].c_str(), static_cast<unsigned long>(values.size()), width, height);
+      failures++;
+      continue;
+    }
+
+    const std::string output = framePath(inputs[i]);
+    try
+    {
+      FaceFilter::SaveDataAsFrame(width, height, &values[0], output);
+    }
+    catch (std::runtime_error* e)
+    {
+      fprintf(stderr, "%s\n", e->what());
+      delete e;
+      failures++;
+      continue;
+    }
+    printf("%s -> %s\n", inputs[i].c_str(), output.c_str());
+  }
+  return failures == 0 ? 0 : 1;
+}
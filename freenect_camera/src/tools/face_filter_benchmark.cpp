@@ -0,0 +1,200 @@
+// Times the stages of the face filters on recorded and synthetic depth frames, without a
+// device or a ROS master.
+//
+//   face_filter_benchmark [--frames 200] [--synthetic-only] [frame.frame...]
+//
+// Frame files are made by csv_to_frame or FaceFilter::SaveDataAsFrame(). Without any, the
+// kinect-2015-09-02 fixture of the unit tests is used when it was found at build time.
+
+#include "../nodelets/face_filter.h"
+#include "../nodelets/face_filter_fixed.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace freenect_camera;
+
+namespace {
+
+struct Input
+{
+  std::string name;
+  uint32_t width;
+  uint32_t height;
+  std::vector<uint16_t> depth;
+};
+
+// A wall with a slope, a few round blobs in front of it at face distances, holes where the
+// sensor saw nothing and a few outliers. Always the same for the same size.
+void makeSyntheticFrame(uint32_t width, uint32_t height, Input& input)
+{
+  char name[64];
+  sprintf(name, "synthetic %ux%u", width, height);
+  input.name = name;
+  input.width = width;
+  input.height = height;
+  input.depth.resize(width * height);
+
+  uint32_t state = width * 7919u + height;
+  for (uint32_t y = 0; y < height; ++y)
+  {
+    for (uint32_t x = 0; x < width; ++x)
+    {
+      state = state * 1103515245u + 12345u;
+      const uint32_t noise = (state >> 16) & 0xFF;
+      input.depth[y * width + x] = noise < 25 ? 0 : static_cast<uint16_t>(2800 + y * 600 / height + noise % 16);
+    }
+  }
+
+  for (uint32_t blob = 0; blob < 6; ++blob)
+  {
+    const int32_t cx = static_cast<int32_t>((blob * 2 + 1) * width / 12);
+    const int32_t cy = static_cast<int32_t>(height / 3 + (blob % 3) * height / 6);
+    const int32_t radius = static_cast<int32_t>(height / 12 + blob * height / 96);
+    const uint16_t distance = static_cast<uint16_t>(700 + blob * 350);
+    for (int32_t y = cy - radius; y <= cy + radius; ++y)
+    {
+      for (int32_t x = cx - radius; x <= cx + radius; ++x)
+      {
+        if (x < 0 || y < 0 || x >= static_cast<int32_t>(width) || y >= static_cast<int32_t>(height))
+          continue;
+        if ((x - cx) * (x - cx) + (y - cy) * (y - cy) <= radius * radius)
+          input.depth[y * width + x] = static_cast<uint16_t>(distance + (x + y) % 24);
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < width * height / 1000; ++i)
+  {
+    state = state * 1103515245u + 12345u;
+    input.depth[(state >> 8) % (width * height)] = static_cast<uint16_t>(state >> 16);
+  }
+}
+
+bool loadFrameFile(const std::string& path, Input& input)
+{
+  try
+  {
+    MappedFrame frame(path);
+    if (frame.PixelType() != FrameFileHeader::PixelDepthUInt16)
+    {
+      fprintf(stderr, "%s: not a depth frame\n", path.c_str());
+      return false;
+    }
+    input.name = path.substr(path.find_last_of("/\\") + 1);
+    input.width = frame.Width();
+    input.height = frame.Height();
+    input.depth.assign(frame.Data(), frame.Data() + frame.Width() * frame.Height());
+    return true;
+  }
+  catch (std::runtime_error* e)
+  {
+    fprintf(stderr, "%s: %s\n", path.c_str(), e->what());
+    delete e;
+    return false;
+  }
+}
+
+double perPixel(uint64_t ns, uint64_t frames, const Input& input)
+{
+  return static_cast<double>(ns) / frames / (static_cast<double>(input.width) * input.height);
+}
+
+// Transforms fresh copies of the input, warming up first so tables are built and caches are
+// warm, and prints one row of averages.
+template<typename Filter>
+void run(const char* engine, Filter& filter, const Input& input, uint32_t frames)
+{
+  std::vector<uint16_t> depth;
+  for (uint32_t i = 0; i < 5; ++i)
+  {
+    depth = input.depth;
+    filter.Transform(input.width, input.height, &depth[0]);
+  }
+
+  FaceFilterStageTimings timings;
+  filter.SetStageTimings(&timings);
+  uint64_t totalNs = 0;
+  for (uint32_t i = 0; i < frames; ++i)
+  {
+    depth = input.depth;
+    const uint64_t start = FaceFilterClockNs();
+    filter.Transform(input.width, input.height, &depth[0]);
+    totalNs += FaceFilterClockNs() - start;
+  }
+  filter.SetStageTimings(NULL);
+
+  printf("%-40s %-8s %8.3f %8.3f %8.3f %8.3f %8.3f %10.1f\n",
+    input.name.c_str(),
+    engine,
+    perPixel(timings.placePointsNs, timings.frames, input),
+    perPixel(timings.applyMaskNs, timings.frames, input),
+    perPixel(timings.applySelectionNs, timings.frames, input),
+    perPixel(timings.filterDepthDataNs, timings.frames, input),
+    perPixel(totalNs, frames, input),
+    frames * 1e9 / totalNs);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t frames = 200;
+  bool syntheticOnly = false;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+      frames = static_cast<uint32_t>(atoi(argv[++i]));
+    else if (strcmp(argv[i], "--synthetic-only") == 0)
+      syntheticOnly = true;
+    else if (argv[i][0] == '-')
+    {
+      fprintf(stderr, "Usage: %s [--frames 200] [--synthetic-only] [frame.frame...]\n", argv[0]);
+      return 2;
+    }
+    else
+      paths.push_back(argv[i]);
+  }
+#ifdef FACE_FILTER_BENCHMARK_FRAME
+  if (paths.empty() && !syntheticOnly)
+    paths.push_back(FACE_FILTER_BENCHMARK_FRAME);
+#endif
+  if (frames == 0)
+    frames = 1;
+
+  std::vector<Input> inputs;
+  for (size_t i = 0; i < paths.size() && !syntheticOnly; ++i)
+  {
+    Input input;
+    if (!loadFrameFile(paths[i], input))
+      return 1;
+    inputs.push_back(input);
+  }
+  const uint32_t sizes[][2] = { { 320, 240 }, { 640, 480 }, { 1280, 1024 } };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+  {
+    inputs.push_back(Input());
+    makeSyntheticFrame(sizes[i][0], sizes[i][1], inputs.back());
+  }
+
+  // ns/pixel per stage, then for the whole Transform()
+  printf("%-40s %-8s %8s %8s %8s %8s %8s %10s\n", "input", "engine", "place", "mask", "select", "filter", "total", "frames/s");
+  for (size_t i = 0; i < inputs.size(); ++i)
+  {
+    // The driver's default, and the general one with the same parameters
+    FixedFaceFilterHistogramTransform<30, 20, 5, 1>* fixed = new FixedFaceFilterHistogramTransform<30, 20, 5, 1>();
+    run("fixed", *fixed, inputs[i], frames);
+    delete fixed;
+
+    FaceFilterHistogramTransform runtime;
+    run("runtime", runtime, inputs[i], frames);
+
+    // Transforms the same frame over and over, so this is its best case
+    FaceFilterHistogramTransform incremental;
+    incremental.SetIncremental(true);
+    run("incr", incremental, inputs[i], frames);
+  }
+  return 0;
+}